@@ -20,514 +20,4436 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <pthread.h>
 #include "radixtree.h"
 
+/*
+ * Discriminator byte search uses AVX2 or SSE2 when the compiler targets
+ * them (e.g. -mavx2), with a portable scalar fallback. Define
+ * RT_NO_SIMD to force the scalar version.
+ */
+#if !defined(RT_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define RT_SIMD_AVX2
+#define RT_SIMD_SSE2
+#elif !defined(RT_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define RT_SIMD_SSE2
+#endif
+
+/*
+ * Child pointers, parent pointers and values can be changed while
+ * concurrent readers (RT_FLAG_CONCURRENT) look at them, so they are
+ * published with release stores and read with acquire loads.
+ */
+#define RT_LOAD(p)    __atomic_load_n((p),__ATOMIC_ACQUIRE)
+#define RT_STORE(p,v) __atomic_store_n((p),(v),__ATOMIC_RELEASE)
+#define RT_SHARED(t)  ((t)->epoch != NULL)
+#define RT_COUNTED(t) ((t)->flags & RT_FLAG_COUNT)
+
 typedef struct _node rt_node;
 
+/*
+ * Node kinds
+ *
+ * Nodes adapt their child table to their fanout:
+ *   NODE4, NODE16  sorted discriminator bytes, parallel child array
+ *   NODE48         256 byte index (slot+1, 0 if empty) into 48 children
+ *   NODE256        children indexed directly by the discriminator byte
+ * A node is promoted to the next kind when it is full, and demoted
+ * again when removal leaves it sparse.
+ *
+ * Each node is a single allocation: the header, followed by the child
+ * array, the discriminator bytes or index (NODE4-NODE48), and finally
+ * the node key. Allocation sizes are rounded up to NODE_ALIGN.
+ */
+enum {
+    NODE4,
+    NODE16,
+    NODE48,
+    NODE256
+};
+
+static const uint16_t node_cap[] = { NODE_INIT_SIZE, 16, 48, 256 };
+static const uint16_t node_nbytes[] = { NODE_INIT_SIZE, 16, 256, 0 };
+
+/* demote a node once it holds no more than this many children */
+static const uint16_t node_min[] = { 0, 3, 12, 40 };
+
 struct _node {
-    size_t klen;        /* key length */
-    uint8_t lcnt;       /* leaf node count */
-    uint8_t lalloc;     /* leaf alloc size */
-    unsigned char *key; /* node key */
-    void *value;        /* node value; NULL if placeholder node */
     rt_node *parent;    /* parent node */
-    struct _node **leaf;
+    void *value;        /* node value; NULL if placeholder node */
+    uint32_t klen;      /* key length */
+    union {
+        uint32_t lock;  /* writer lock and version, see rt_lock */
+        uint32_t count; /* values in the subtree, with RT_FLAG_COUNT */
+    };
+    uint8_t type;       /* node kind: NODE4 ... NODE256 */
+    uint16_t lcnt;      /* leaf node count, up to 256 */
+    uint32_t asize;     /* allocation size, in bytes */
+    unsigned char data[]; /* children, discriminators and key */
 };
 
+#define NODE_ALIGN 16
+/* longest node key; longer keys are spread over a chain of nodes */
+#define NODE_KEY_MAX (UINT32_MAX/2)
+#define NODE_CHILD(n) ((rt_node **)(n)->data)
+#define NODE_BYTES(n) ((unsigned char *)(NODE_CHILD(n) + node_cap[(n)->type]))
+#define NODE_KEY(n)   (NODE_BYTES(n) + node_nbytes[(n)->type])
+
+/*
+ * Arena allocator
+ *
+ * Node allocations are carved out of large slabs and recycled through
+ * free lists, one per NODE_ALIGN sized class. Allocations larger than
+ * the biggest class get a dedicated slab. Slabs are only returned when
+ * the tree is freed, which then costs O(slabs) instead of O(nodes).
+ */
+
+#define ARENA_SLAB_SIZE (64*1024)
+#define ARENA_CLASSES   192     /* blocks up to ARENA_CLASSES*NODE_ALIGN */
+
+typedef struct _slab rt_slab;
+
+struct _slab {
+    rt_slab *next;      /* slab list */
+    rt_slab *prev;
+};
+
+typedef struct {
+    rt_slab *slabs;            /* all slabs, including oversized blocks */
+    unsigned char *ptr;        /* next free byte in the current slab */
+    unsigned char *end;        /* end of the current slab */
+    void *freelist[ARENA_CLASSES];
+} rt_arena;
+
+/*
+ * Epoch based reclamation
+ *
+ * Readers and writers announce the global epoch in a slot for as long
+ * as they may hold node pointers. Unlinked nodes are retired with the
+ * epoch at that time, and freed once every announced epoch is newer.
+ * The slots are a cache line apart so that threads do not contend.
+ */
+
+#define EPOCH_SLOTS   128
+#define EPOCH_BATCH   64        /* initial retire list size */
+
+typedef struct {
+    uint64_t epoch;             /* announced epoch; 0 if unused */
+    const void *owner;          /* thread that claimed the slot */
+    uint32_t refs;              /* pins sharing the slot */
+    char pad[64-sizeof(uint64_t)-sizeof(void *)-sizeof(uint32_t)];
+} rt_slot;
+
+typedef struct {
+    void *p;
+    size_t size;
+    uint64_t epoch;
+} rt_retired;
+
+typedef struct {
+    uint64_t epoch;             /* global epoch, starting at 1 */
+    uint32_t root_lock;         /* guards the tree root slot */
+    uint32_t retire_lock;       /* guards the retire list */
+    uint32_t arena_lock;        /* guards the arena, if any */
+    rt_retired *retired;
+    size_t nretired;
+    size_t cap;
+    rt_slot slots[EPOCH_SLOTS];
+} rt_epoch;
+
 struct _rt_tree {
-    uint8_t alsize;            /* alphabet size (max _node.lalloc value */
+    uint16_t alsize;           /* alphabet size (max _node.lcnt value) */
     void (*free)(void *);      /* memory free callback */
     void (*vfree)(void *);     /* value free callback */
     void * (* malloc)(size_t); /* memory alloc callback */
     void * (* realloc)(void *,size_t); /* memory realloc callback */
+    unsigned int flags;        /* RT_FLAG_* options */
+    rt_arena *arena;           /* node allocator; NULL to use callbacks */
+    rt_epoch *epoch;           /* reader epochs; NULL unless concurrent */
     rt_node *root;             /* radixtree root node */
 };
 
+typedef struct {
+    const rt_node *node;
+    int c;                     /* byte of the child visited last, or -1 */
+    size_t klen;               /* key length including this node */
+} rt_iter_frame;
+
 struct _rt_iter {
     const rt_tree *t;
-    const rt_node *root;
-    rt_node *curr;
+    const rt_node *curr;
+    void *value;               /* value of curr seen by rt_iter_next */
     void (*free)(void *);      /* iter free callback */
-    unsigned char key[MAX_KEY_LENGTH+1];
+    int slot;                  /* epoch slot held by the iterator */
+    size_t depth;              /* number of stack frames */
+    size_t klen;               /* length of the current key */
+    size_t scap, kcap;         /* stack and key buffer capacity */
+    rt_iter_frame *stack;      /* istack, or on the heap for deep paths */
+    unsigned char *key;        /* ikey, or on the heap for long keys */
+    unsigned char *start;      /* range start, or NULL */
+    unsigned char *end;        /* range end (exclusive), or NULL */
+    size_t slen, elen;
+    int desc;                  /* rt_iter_next walks down (RT_ITER_DESC) */
+    rt_iter_frame istack[RT_ITER_DEPTH];
+    unsigned char ikey[RT_ITER_KEYLEN];
 };
 
+/*
+ * Keys have no length limit, so the map functions keep their key
+ * buffers inline for keys of up to MAX_KEY_LENGTH bytes and only move
+ * them to the heap for longer ones. Iterators are allocated for every
+ * prefix query and kept small: their stacks and keys start out inline
+ * with RT_ITER_DEPTH frames and RT_ITER_KEYLEN bytes. rt_grow makes
+ * room for @a need elements of @a size bytes in the array @a p of *cap
+ * elements, which starts out as @a inl. It returns the possibly moved
+ * array, or NULL if out of memory.
+ */
+static void *
+rt_grow(void *p, size_t *cap, size_t need, size_t size, const void *inl,
+        void * (* _malloc)(size_t), void (*_free)(void *))
+{
+    size_t ncap = *cap;
+    void *r;
+    if(need <= ncap) return p;
+    while(ncap < need) ncap *= 2;
+    if(!(r = _malloc(ncap*size))) return NULL;
+    memcpy(r,p,*cap*size);
+    if(p != inl) _free(p);
+    *cap = ncap;
+    return r;
+}
+
+#define ALIGN_SIZE(sz) (((sz) + NODE_ALIGN-1) & ~((size_t)NODE_ALIGN-1))
+
 static void
-rt_node_free(const rt_tree *t, rt_node *n)
+rt_slab_link(rt_arena *a, rt_slab *s)
 {
-    uint8_t i;
-    rt_node **l;
-    if(!n || !t) return;
-    for(i=0,l=n->leaf;i<n->lcnt;i++,l++)
-        rt_node_free(t, *l);
-    if(n->value && t->vfree) t->vfree(n->value);
-    if(n->key) t->free(n->key);
-    if(n->leaf) t->free(n->leaf);
-    t->free(n);
+    s->prev = NULL;
+    s->next = a->slabs;
+    if(a->slabs) a->slabs->prev = s;
+    a->slabs = s;
 }
 
-static rt_node *
-rt_node_new(const rt_tree *t, uint8_t c, const unsigned char *key,
-        size_t keylen)
+static void *
+rt_arena_alloc(const rt_tree *t, size_t sz)
 {
-    rt_node *n = NULL;
-    uint8_t s = c;
-    size_t sz = sizeof(*n);
-    if(!t || !t->malloc) return NULL;
+    rt_arena *a = t->arena;
+    rt_slab *s;
+    void *p;
+    size_t cls;
 
-    n = t->malloc(sz);
-    if(!n) return NULL;
-    memset(n,0,sz);
-    if(s < 1) s = NODE_INIT_SIZE;
-    else if(s > t->alsize) s = t->alsize;
-    n->lalloc = s;
-    n->klen = keylen;
-    n->leaf = t->malloc(s*sizeof(n));
-    if(!n->leaf) goto fail;
-    if(key && keylen>0) {
-        n->key = t->malloc(keylen+1);
-        if(!n->key) goto fail;
-        memcpy(n->key,key,keylen);
-        n->key[keylen] = 0;
+    sz = ALIGN_SIZE(sz);
+    if(sz > ARENA_CLASSES*NODE_ALIGN) {
+        s = t->malloc(sizeof(*s)+sz);
+        if(!s) return NULL;
+        rt_slab_link(a,s);
+        return s+1;
     }
-    return n;
-fail:
-    rt_node_free(t,n);
-    return NULL;
+    cls = sz/NODE_ALIGN - 1;
+    if((p = a->freelist[cls]) != NULL) {
+        a->freelist[cls] = *(void **)p;
+        return p;
+    }
+    if((size_t)(a->end - a->ptr) < sz) {
+        s = t->malloc(sizeof(*s)+ARENA_SLAB_SIZE);
+        if(!s) return NULL;
+        rt_slab_link(a,s);
+        a->ptr = (unsigned char *)(s+1);
+        a->end = a->ptr + ARENA_SLAB_SIZE;
+    }
+    p = a->ptr;
+    a->ptr += sz;
+    return p;
 }
 
 static void
-rt_node_print(rt_node *n, int depth)
+rt_arena_free(const rt_tree *t, void *p, size_t sz)
 {
-    int i;
-    rt_node **l;
-    for(i=0;i<depth;i++) printf("\t");
-    if(n)
-    {
-        if(n->key) printf("\"%.*s\"",(int)n->klen,n->key);
-        else       printf("NULL");
-        if(n->value) printf(" = addr(%p)\n",n->value);
-        else         printf(" = NULL\n");
-        for(i=0,l=n->leaf;i<n->lcnt;i++,l++) rt_node_print(*l,depth+1);
-    } else printf("NULL\n");
+    rt_arena *a = t->arena;
+    rt_slab *s;
+
+    sz = ALIGN_SIZE(sz);
+    if(sz > ARENA_CLASSES*NODE_ALIGN) {
+        s = (rt_slab *)p - 1;
+        if(s->prev) s->prev->next = s->next;
+        else        a->slabs = s->next;
+        if(s->next) s->next->prev = s->prev;
+        t->free(s);
+        return;
+    }
+    *(void **)p = a->freelist[sz/NODE_ALIGN - 1];
+    a->freelist[sz/NODE_ALIGN - 1] = p;
 }
 
-static size_t
-_maxmatch(const unsigned char *key, const unsigned char *match, size_t len)
+static void
+rt_arena_release(const rt_tree *t)
 {
-    register unsigned char *m1 = (unsigned char *)key,
-             *m2 = (unsigned char *)match;
-    unsigned char *me1 = m1+len, *me2 = m2+len;
-    while(*m1 == *m2 && m1<me1 && m2<me2) {
-        m1++; m2++;
+    rt_slab *s, *next;
+    for(s=t->arena->slabs;s;s=next) {
+        next = s->next;
+        t->free(s);
     }
-    return m1-key;
+    t->free(t->arena);
 }
 
 /*
- * Implement a custom binary search that returns the last search
- * location. This location is either a match or the location
- * where the node should be inserted [+-] 1
+ * Writer locks
+ *
+ * With concurrent writers every node carries a lock word: bit 0 is the
+ * lock, bit 1 marks a node that was replaced or unlinked (obsolete),
+ * and the rest counts the changes made under the lock. Writers lock
+ * top-down, i.e. a node only after its parent, so they cannot deadlock.
+ * Readers never look at the lock: they only follow atomically published
+ * pointers into nodes that no longer change.
  */
 
+#define LOCK_BIT     1u
+#define OBSOLETE_BIT 2u
+#define VERSION_INC  4u
+
+/* Take the lock @a w; fails (returns 0) if it was marked obsolete */
 static int
-rt_bsearch(const unsigned char *key, const rt_node **leaf,
-        size_t leafcnt, rt_node ***match)
+rt_lock(uint32_t *w)
 {
-    size_t left = 0, right = leafcnt, index = 0;
-    int cmp = 0;
-    while(left < right)
-    {
-        index = (right+left)/2;
-        cmp = *key - leaf[index]->key[0];
-        if(cmp < 0)
-            right = index;
-        else if (cmp > 0)
-            left = index+1;
-        else break;
+    uint32_t v;
+    int spins = 0;
+    while(1) {
+        v = __atomic_load_n(w,__ATOMIC_RELAXED);
+        if(v & OBSOLETE_BIT) return 0;
+        if(!(v & LOCK_BIT) && __atomic_compare_exchange_n(w,&v,v|LOCK_BIT,
+                    0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+            return 1;
+        if(++spins % 64 == 0) sched_yield();
     }
-    if(match) *match = (rt_node **)&leaf[index];
-    return cmp;
 }
 
-static size_t
-rt_node_grow(const rt_tree *t, rt_node *n)
-{
-    size_t ns = n->lalloc;
-    rt_node **rt = NULL;
-    ns *= 2;
-    if(ns>t->alsize) ns = t->alsize;
-    if(ns == n->lalloc) return 0;
-    if(t->realloc) {
-        rt = t->realloc(n->leaf,ns*sizeof(rt));
-        if(!rt) return 0;
-    } else {
-        rt = t->malloc(ns*sizeof(rt));
-        if(!rt) return 0;
-        memcpy(rt,n->leaf,n->lalloc);
-        t->free(n->leaf);
-    }
-    n->lalloc = ns;
-    n->leaf = rt;
-    return ns;
+/* Release the lock @a w, bumping its version; the obsolete mark stays */
+static void
+rt_unlock(uint32_t *w)
+{
+    __atomic_fetch_add(w,VERSION_INC-LOCK_BIT,__ATOMIC_RELEASE);
 }
 
-typedef enum {
-    NODE_SET,
-    NODE_GET,
-    NODE_PREFIX
-} rt_get_mode;
+/*
+ * Node memory goes through these wrappers, which dispatch to either the
+ * arena or the user callbacks. The arena needs the allocation size on
+ * free, so callers always pass it along.
+ */
 
-static rt_node *
-rt_node_get(    const rt_tree *root, rt_node *n,
-        const unsigned char *key, const unsigned char *ptr,
-        size_t lkey, rt_get_mode mode)
+static void *
+rt_mem_alloc(const rt_tree *t, size_t sz)
 {
-    rt_node *node = NULL, **p;
-    size_t len;
-    int diff;
-    if(!root || !n || !key || lkey < 1 || !ptr || ptr > key+lkey)
-        return NULL;
-    assert(lkey <= strlen((char*)key));
-
-    len = lkey - (ptr - key);
-    if(n->lcnt == 0) {
-        if(mode!=NODE_SET) return NULL;
-        node = rt_node_new(root,0,ptr,len);
-        if(!node) return NULL;
-        n->leaf[0] = node;
-        node->parent = n;
-        n->lcnt++;
-        return node;
-    }
-
-    /*
-     * Search for the key
-     * If not found, return the location for it to be added
-     */
-    diff = rt_bsearch(ptr,(const rt_node **)n->leaf,n->lcnt,&p);
-    if(!p) return NULL;
-
-    if(diff==0) /* found (partial?) match */
-    {
-        rt_node *index = *p, *child;
-        size_t mm = _maxmatch(ptr,index->key,
-                index->klen < len ? index->klen : len);
-        if(mode == NODE_SET) {
-
-            if(mm < index->klen) {
-                rt_node **tmp;
-                int i;
-                /* otherwise, split add child and update this node */
-                child = rt_node_new(root,0,index->key+mm,index->klen-mm);
-                if(!child) {
-                    /* failed to split and add child node */
-                    return NULL;
-                }
-                tmp = root->malloc(NODE_INIT_SIZE*sizeof(rt_node *));
-                if(!tmp) return NULL;
-                child->lalloc = index->lalloc;
-                child->lcnt   = index->lcnt;
-                child->leaf   = index->leaf;
-                child->value  = index->value;
-                child->parent = index;
-                index->klen    = mm;
-                index->key[mm] = 0;
-                index->value   = NULL;
-                index->leaf    = tmp;
-                index->lalloc  = NODE_INIT_SIZE;
-                index->lcnt    = 1;
-                index->leaf[0] = child;
-                /* need to update child parent refs, if necessary */
-                for(i=0,tmp=child->leaf;i<child->lcnt&&*tmp;i++,tmp++)
-                    (*tmp)->parent=child;
-            }
-        }
-        if(mm==len &&
-                (index->klen==mm || (mode==NODE_PREFIX && index->klen>mm))) {
-            return index;
-        }
-        return rt_node_get(root,index,key,ptr+mm,lkey,mode);
+    void *p;
+    if(!t->arena) return t->malloc(sz);
+    if(t->epoch) rt_lock(&t->epoch->arena_lock);
+    p = rt_arena_alloc(t,sz);
+    if(t->epoch) rt_unlock(&t->epoch->arena_lock);
+    return p;
+}
+
+static void
+rt_mem_free(const rt_tree *t, void *p, size_t sz)
+{
+    if(!t->arena) {
+        t->free(p);
+        return;
+    }
+    if(t->epoch) rt_lock(&t->epoch->arena_lock);
+    rt_arena_free(t,p,sz);
+    if(t->epoch) rt_unlock(&t->epoch->arena_lock);
+}
 
-    } else if(mode==NODE_SET) {
-        size_t offset = p - n->leaf;
+#ifdef __GNUC__
+static __thread unsigned int rt_epoch_hint;
+#else
+static unsigned int rt_epoch_hint;
+#endif
 
-        /* rt_node_grow may realloc the n->leaf location
-         * 1. save the p offset
-         * 2. redeclare p based on the new n->leaf location and
-         *    offset
-         */
+/*
+ * Pin the current epoch for the calling thread; returns the slot to
+ * pass to rt_epoch_exit, or -1 if the tree is not concurrent. Each
+ * thread remembers the slot it got last, so it normally takes the
+ * same uncontended slot every time. A thread that already holds a
+ * slot (an open iterator, say) shares it instead of taking another:
+ * the older epoch announced there covers the new pin as well, and one
+ * thread can then hold any number of iterators.
+ */
+static int
+rt_epoch_enter(const rt_tree *t)
+{
+    rt_epoch *e = t->epoch;
+    const void *self = &rt_epoch_hint;
+    uint64_t zero, now;
+    uint32_t refs;
+    unsigned int i;
+    if(!e) return -1;
 
-        if(mode == NODE_SET
-                && n->lcnt >= n->lalloc
-                && rt_node_grow(root,n)<1) {
-            return NULL;
+    i = rt_epoch_hint;
+    if(__atomic_load_n(&e->slots[i].owner,__ATOMIC_RELAXED) == self) {
+        refs = __atomic_load_n(&e->slots[i].refs,__ATOMIC_ACQUIRE);
+        while(refs) {
+            if(__atomic_compare_exchange_n(&e->slots[i].refs,&refs,refs+1,
+                        0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+                return (int)i;
         }
-
-        p = n->leaf + offset;
-        node = rt_node_new(root,0,ptr,len);
-        if(!node) return NULL;
-        node->parent = n;
-        if(diff > 0) {
-            memmove(p+2,p+1,sizeof(p)*(n->lcnt-offset-1));
-            p[1] = node;
-        } else {
-            memmove(p+1,p,sizeof(p)*(n->lcnt-offset));
-            *p = node;
+    }
+    for(;;i++) {
+        if(i >= EPOCH_SLOTS) {
+            i = 0;
+            sched_yield();
         }
-        n->lcnt++;
-        return node;
+        zero = 0;
+        now = __atomic_load_n(&e->epoch,__ATOMIC_ACQUIRE);
+        if(__atomic_compare_exchange_n(&e->slots[i].epoch,&zero,now,0,
+                    __ATOMIC_SEQ_CST,__ATOMIC_RELAXED))
+            break;
     }
-
-    return NULL;
+    /* order the announcement before any loads of tree pointers */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __atomic_store_n(&e->slots[i].owner,self,__ATOMIC_RELAXED);
+    __atomic_store_n(&e->slots[i].refs,1,__ATOMIC_RELEASE);
+    rt_epoch_hint = i;
+    return (int)i;
 }
 
-rt_tree *
-rt_tree_new(uint8_t albet_size, void (*_vfree)(void*))
+static void
+rt_epoch_exit(const rt_tree *t, int slot)
 {
-    return rt_tree_malloc(albet_size, _vfree, malloc, realloc, free);
+    rt_slot *sl;
+    if(slot < 0) return;
+    sl = &t->epoch->slots[slot];
+    /* the last pin gives the slot back; an iterator may be freed by a
+     * thread other than the one that opened it */
+    if(__atomic_sub_fetch(&sl->refs,1,__ATOMIC_ACQ_REL)) return;
+    __atomic_store_n(&sl->owner,NULL,__ATOMIC_RELAXED);
+    __atomic_store_n(&sl->epoch,0,__ATOMIC_RELEASE);
 }
 
-rt_tree *
-rt_tree_malloc( uint8_t albet_size,
-        void (*_vfree)(void*),
-        void* (*_malloc)(size_t),
-        void* (*_realloc)(void *,size_t),
-        void (*_free)(void*))
+/*
+ * Start a new epoch and return the oldest epoch still announced; the
+ * nodes retired before it are unreachable. With @a wait set, first wait
+ * for the threads in older epochs to leave, so that everything retired
+ * so far becomes free.
+ */
+static uint64_t
+rt_epoch_advance(const rt_tree *t, int wait)
 {
-    rt_tree *t = NULL;
-    if(!_malloc || !_free || albet_size<1) return NULL;
-    t = _malloc(sizeof(rt_tree));
-    if(!t) return NULL;
-    t->malloc = _malloc;
-    t->realloc = _realloc;
-    t->free = _free;
-    t->vfree = _vfree;
-    t->alsize = albet_size>MAX_ALPHABET_SIZE ? MAX_ALPHABET_SIZE:albet_size;
-    t->root = rt_node_new(t,0,NULL,0);
-    t->root->parent = NULL;
-    return t;
-}
+    rt_epoch *e = t->epoch;
+    uint64_t now, min, s;
+    size_t i;
 
-void
-rt_tree_free(rt_tree *t)
-{
-    if(!t) return;
-    rt_node_free(t,t->root);
-    t->free(t);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    now = __atomic_add_fetch(&e->epoch,1,__ATOMIC_SEQ_CST);
+    min = now;
+    for(i=0;i<EPOCH_SLOTS;i++) {
+        while((s = __atomic_load_n(&e->slots[i].epoch,__ATOMIC_SEQ_CST))
+                && s < now && wait)
+            sched_yield();
+        if(s && s < min) min = s;
+    }
+    return min;
 }
 
-void *
-rt_tree_get(const rt_tree *t, const unsigned char *key, size_t lkey)
+/* Free the retired nodes older than @a min; needs the retire lock */
+static void
+rt_epoch_free(const rt_tree *t, uint64_t min)
 {
-    rt_node *n;
-    if(!t) return NULL;
-    n = rt_node_get(t,t->root,key,key,
-            lkey<MAX_KEY_LENGTH?lkey:MAX_KEY_LENGTH,NODE_GET);
-    return (n && n->value) ? n->value : NULL;
+    rt_epoch *e = t->epoch;
+    size_t i, j;
+    for(i=0, j=0;i<e->nretired;i++) {
+        if(e->retired[i].epoch < min)
+            rt_mem_free(t,e->retired[i].p,e->retired[i].size);
+        else
+            e->retired[j++] = e->retired[i];
+    }
+    e->nretired = j;
 }
 
-int
-rt_tree_set(const rt_tree *t, const unsigned char *key,
-        size_t lkey, void *value)
+/*
+ * Free node @a n once no other thread can reach it any more; it must
+ * already be unlinked, and be locked by the caller when there are
+ * concurrent writers. Without concurrent readers this frees it right
+ * away. Collections run whenever the retire list fills up.
+ */
+static void
+rt_node_retire(const rt_tree *t, rt_node *n)
 {
-    rt_node *n;
-    /* rt_node_get will add the key, don't do this if value==NULL */
-    if(!t || !value) return 0;
-    n = rt_node_get(t,t->root,key,key,
-            lkey<MAX_KEY_LENGTH?lkey:MAX_KEY_LENGTH,NODE_SET);
-    if(n) {
-        n->value = value;
-        return 1;
+    rt_epoch *e = t->epoch;
+    rt_retired *r;
+    if(!e) {
+        rt_mem_free(t,n,n->asize);
+        return;
     }
+    /* writers waiting for the lock of n give up and restart */
+    __atomic_fetch_or(&n->lock,OBSOLETE_BIT,__ATOMIC_RELEASE);
 
-    return 0;
+    rt_lock(&e->retire_lock);
+    while(e->nretired == e->cap) {
+        if(e->cap) rt_epoch_free(t,rt_epoch_advance(t,0));
+        /* grow unless the collection freed at least half of the list */
+        if(e->cap && e->nretired <= e->cap/2) break;
+        r = t->malloc((e->cap ? e->cap*2 : EPOCH_BATCH)*sizeof(*r));
+        if(r) {
+            if(e->retired) {
+                memcpy(r,e->retired,e->nretired*sizeof(*r));
+                t->free(e->retired);
+            }
+            e->retired = r;
+            e->cap = e->cap ? e->cap*2 : EPOCH_BATCH;
+        } else {
+            /* out of memory: wait for other threads to move on and
+             * release nodes (waiting for them could deadlock) */
+            rt_unlock(&e->retire_lock);
+            sched_yield();
+            rt_lock(&e->retire_lock);
+        }
+    }
+    e->retired[e->nretired].p = n;
+    e->retired[e->nretired].size = n->asize;
+    /* the unlinking store must be visible before the epoch is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    e->retired[e->nretired].epoch = __atomic_load_n(&e->epoch,
+            __ATOMIC_RELAXED);
+    e->nretired++;
+    rt_unlock(&e->retire_lock);
 }
 
-void *
-rt_tree_setdefault(const rt_tree *t, const unsigned char *key,
-        size_t lkey, void *value)
-{
-    rt_node *n;
-    /* rt_node_get will add the key, don't do this if value==NULL */
-    if(!t || !value) return NULL;
-    n = rt_node_get(t,t->root,key,key,
-            lkey<MAX_KEY_LENGTH?lkey:MAX_KEY_LENGTH,NODE_SET);
+/*
+ * Discriminator byte search
+ *
+ * rt_bytes_find returns the index of @a c in the @a n bytes at @a k, or
+ * -1 if it is not there. rt_bytes_lt returns the number of bytes in the
+ * sorted array @a k that are less than @a c, i.e. its insert position.
+ * Both only read the first @a n bytes, so they work on any array.
+ */
 
-    if(n) {
-        if(!n->value) n->value = value;
-        return n->value;
+#ifdef RT_SIMD_SSE2
+#define SIMD_BIAS 0x80  /* SSE2 only has signed byte compares */
+#endif
+
+static inline int
+rt_bytes_find(const unsigned char *k, int n, unsigned char c)
+{
+    int i = 0;
+#ifdef RT_SIMD_AVX2
+    __m256i c32 = _mm256_set1_epi8((char)c);
+    for(;i+32<=n;i+=32) {
+        uint32_t m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c32,
+                    _mm256_loadu_si256((const __m256i *)(k+i))));
+        if(m) return i + __builtin_ctz(m);
     }
-    return NULL;
+#endif
+#ifdef RT_SIMD_SSE2
+    {
+        __m128i c16 = _mm_set1_epi8((char)c);
+        for(;i+16<=n;i+=16) {
+            int m = _mm_movemask_epi8(_mm_cmpeq_epi8(c16,
+                        _mm_loadu_si128((const __m128i *)(k+i))));
+            if(m) return i + __builtin_ctz(m);
+        }
+    }
+#endif
+    for(;i<n;i++)
+        if(k[i] == c) return i;
+    return -1;
 }
 
-int
-rt_tree_remove(const rt_tree *t, const unsigned char *key, size_t lkey)
+static inline int
+rt_bytes_lt(const unsigned char *k, int n, unsigned char c)
 {
-    rt_node *n;
-    if(!t) return 0;
-    n = rt_node_get(t,t->root,key,key,
-            lkey<MAX_KEY_LENGTH?lkey:MAX_KEY_LENGTH,NODE_GET);
-
-    if(n && n->value) {
-        n->value = NULL;
-        return 1;
+    int i = 0, cnt = 0;
+#ifdef RT_SIMD_AVX2
+    __m256i b32 = _mm256_set1_epi8((char)SIMD_BIAS),
+            c32 = _mm256_set1_epi8((char)(c^SIMD_BIAS));
+    for(;i+32<=n;i+=32) {
+        __m256i v = _mm256_xor_si256(b32,
+                _mm256_loadu_si256((const __m256i *)(k+i)));
+        cnt += __builtin_popcount(
+                _mm256_movemask_epi8(_mm256_cmpgt_epi8(c32,v)));
     }
-    return 0;
+#endif
+#ifdef RT_SIMD_SSE2
+    {
+        __m128i b16 = _mm_set1_epi8((char)SIMD_BIAS),
+                c16 = _mm_set1_epi8((char)(c^SIMD_BIAS));
+        for(;i+16<=n;i+=16) {
+            __m128i v = _mm_xor_si128(b16,
+                    _mm_loadu_si128((const __m128i *)(k+i)));
+            cnt += __builtin_popcount(
+                    _mm_movemask_epi8(_mm_cmplt_epi8(v,c16)));
+        }
+    }
+#endif
+    for(;i<n;i++)
+        if(k[i] < c) cnt++;
+    return cnt;
 }
 
-void
-rt_tree_print(const rt_tree *t)
+/*
+ * NODE16 variants: the discriminator array always has room for 16
+ * bytes, so compare all of them at once and mask off the unused ones.
+ */
+static inline int
+rt_bytes16_find(const unsigned char *k, int n, unsigned char c)
 {
-    int i;
-    rt_node *r, **l;
-    if(!t || !t->root) printf("NULL");
-    r = t->root;
-    for(i=0,l=r->leaf;i < r->lcnt;i++,l++) rt_node_print(*l,0);
+#ifdef RT_SIMD_SSE2
+    int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8((char)c),
+                _mm_loadu_si128((const __m128i *)k))) & ((1<<n)-1);
+    return m ? __builtin_ctz(m) : -1;
+#else
+    return rt_bytes_find(k,n,c);
+#endif
 }
 
-rt_iter *
-rt_tree_prefix(const rt_tree *t, const unsigned char *prefix,
-        size_t prefixlen)
+static inline int
+rt_bytes16_lt(const unsigned char *k, int n, unsigned char c)
 {
-    rt_iter *iter;
-    rt_node *result = NULL;
-    if(!t) return NULL;
-    if(!prefix || prefixlen < 1)
-        result = t->root;
-    else
-        result = rt_node_get(t, t->root, prefix, prefix,
-                prefixlen<MAX_KEY_LENGTH?prefixlen:MAX_KEY_LENGTH,NODE_PREFIX);
-
-    iter = t->malloc(sizeof(*iter));
-    if(!iter) return NULL;
-    iter->root = result;
-    iter->curr = NULL;
-    iter->t = t;
-    iter->free = t->free;
-    return iter;
+#ifdef RT_SIMD_SSE2
+    __m128i b = _mm_set1_epi8((char)SIMD_BIAS),
+            v = _mm_xor_si128(b,_mm_loadu_si128((const __m128i *)k));
+    return __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(v,
+                    _mm_set1_epi8((char)(c^SIMD_BIAS)))) & ((1<<n)-1));
+#else
+    return rt_bytes_lt(k,n,c);
+#endif
 }
 
-void
-rt_iter_free(rt_iter *iter)
+/* Index of the first non-zero byte in the NODE48 index at or after @a i */
+static inline int
+rt_index_next(const unsigned char *k, int i)
 {
-    if(iter && iter->free) iter->free(iter);
+#ifdef RT_SIMD_SSE2
+    /* scan aligned 16 byte blocks, masking off the bytes before i */
+    __m128i zero = _mm_setzero_si128();
+    int b = i & ~15, m;
+    for(;b<256;b+=16) {
+        m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(zero,
+                    _mm_loadu_si128((const __m128i *)(k+b)))) & 0xffff;
+        if(b < i) m &= ~0u << (i-b);
+        if(m) return b + __builtin_ctz(m);
+    }
+#else
+    for(;i<256;i++)
+        if(k[i]) return i;
+#endif
+    return 256;
 }
 
-int
-rt_iter_next(rt_iter *iter)
+/*
+ * Return the first child whose discriminator byte is greater than @a c
+ * (pass -1 for the first child), or NULL if there is none. The child
+ * byte is stored in @a cc.
+ */
+static rt_node *
+rt_node_next(const rt_node *n, int c, int *cc)
 {
-    rt_node *c,**t;
-    unsigned char *pkey;
-    if(!iter || !iter->root) return 0;
-    if(iter->curr == NULL) {
-        iter->curr = (rt_node*)iter->root;
-        if(iter->root->value != NULL) return 1;
+    rt_node **l = NODE_CHILD(n), *r;
+    const unsigned char *k = NODE_BYTES(n);
+    int i;
+    switch(n->type) {
+    case NODE4:
+        if(c >= 255) break;
+        i = c < 0 ? 0 : rt_bytes_lt(k,n->lcnt,c+1);
+        if(i < n->lcnt) {
+            *cc = k[i];
+            return RT_LOAD(&l[i]);
+        }
+        break;
+    case NODE16:
+        if(c >= 255) break;
+        i = c < 0 ? 0 : rt_bytes16_lt(k,n->lcnt,c+1);
+        if(i < n->lcnt) {
+            *cc = k[i];
+            return RT_LOAD(&l[i]);
+        }
+        break;
+    case NODE48:
+        i = rt_index_next(k,c+1);
+        if(i < 256) {
+            *cc = i;
+            return RT_LOAD(&l[k[i]-1]);
+        }
+        break;
+    default:
+        for(i=c+1;i<256;i++) {
+            if((r = RT_LOAD(&l[i]))) {
+                *cc = i;
+                return r;
+            }
+        }
     }
+    return NULL;
+}
 
-    /* First try to recurse through child nodes */
-    while(iter->curr->lcnt > 0) {
-        iter->curr = iter->curr->leaf[0];
-        if(iter->curr->value) return 1;
-    }
-    c = iter->curr;
-    while(1) {
-        pkey = c->key;
-        if(!c->parent) return 0;
-        c = c->parent;
-
-        /* Go up to parent to scan siblings */
-        if(c->lcnt > 0) {
-            rt_bsearch(pkey,(const rt_node **)c->leaf,c->lcnt,&t);
-
-            while(t && *t && t<c->leaf+c->lcnt-1) {
-                t++;
-                /* If value is NULL, node is *empty*; return */
-                if((*t)->value != NULL) {
-                    iter->curr = *t;
-                    return 1;
-                }
-                /* Else if there are no children; return */
-                else if((*t)->lcnt > 0) {
-                    t = &(*t)->leaf[0];
-                    c=(*t)->parent;
-                    if((*t)->value) {
-                        iter->curr = *t;
-                        return 1;
-                    }
-                }
+#define NODE_FOREACH(n,c,l) \
+    for((l)=rt_node_next((n),-1,&(c));(l);(l)=rt_node_next((n),(c),&(c)))
+
+/*
+ * Return the last child whose discriminator byte is less than @a c
+ * (pass 256 for the last child), or NULL if there is none. The child
+ * byte is stored in @a cc.
+ */
+static rt_node *
+rt_node_prev(const rt_node *n, int c, int *cc)
+{
+    rt_node **l = NODE_CHILD(n), *r;
+    const unsigned char *k = NODE_BYTES(n);
+    int i;
+    if(c <= 0) return NULL;
+    switch(n->type) {
+    case NODE4:
+        i = c > 255 ? n->lcnt : rt_bytes_lt(k,n->lcnt,c);
+        break;
+    case NODE16:
+        i = c > 255 ? n->lcnt : rt_bytes16_lt(k,n->lcnt,c);
+        break;
+    case NODE48:
+        for(i=c-1;i>=0;i--) {
+            if(k[i]) {
+                *cc = i;
+                return RT_LOAD(&l[k[i]-1]);
             }
         }
-
-        /* if we've returned to the original root node, stop */
-        if(c==iter->root) return 0;
+        return NULL;
+    default:
+        for(i=c-1;i>=0;i--) {
+            if((r = RT_LOAD(&l[i]))) {
+                *cc = i;
+                return r;
+            }
+        }
+        return NULL;
     }
-    return 0;
+    if(i == 0) return NULL;
+    *cc = k[i-1];
+    return RT_LOAD(&l[i-1]);
 }
 
-const unsigned char *
-rt_iter_key(const rt_iter *iter)
+/*
+ * Return the child with discriminator byte @a c, or NULL. This is the
+ * reader side: a concurrent writer only ever changes the child slots
+ * of a node readers can see, so those are loaded atomically.
+ */
+static inline rt_node *
+rt_node_child(const rt_node *n, unsigned char c)
 {
-    rt_node *n;
-    static unsigned char *ptr;
-    size_t len = MAX_KEY_LENGTH,i;
-    if(!iter || !iter->curr || !iter->key) return NULL;
-
-    /* This builds up the string by traversing the tree
-     * from the current node to the root.
-     */
-    ptr = iter->key+MAX_KEY_LENGTH;
-    *ptr = 0; ptr--;
-    n = iter->curr;
-    while(len>0 && n) {
-        i = n->klen;
-        ptr-=i;
-        len-=i;
-
-        memcpy(ptr,n->key,i);
-        n = n->parent;
+    rt_node **l = NODE_CHILD(n);
+    const unsigned char *k = NODE_BYTES(n);
+    int i;
+    switch(n->type) {
+    case NODE4:
+        for(i=0;i<n->lcnt;i++)
+            if(k[i] == c) return RT_LOAD(&l[i]);
+        return NULL;
+    case NODE16:
+        i = rt_bytes16_find(k,n->lcnt,c);
+        return i < 0 ? NULL : RT_LOAD(&l[i]);
+    case NODE48:
+        return k[c] ? RT_LOAD(&l[k[c]-1]) : NULL;
+    default:
+        return RT_LOAD(&l[c]);
     }
-    return ptr;
 }
 
-const void *
-rt_iter_value(const rt_iter *iter)
+/* Return the slot of the child with discriminator byte @a c */
+static inline rt_node **
+rt_node_find(const rt_node *n, unsigned char c)
 {
-    if(!iter || !iter->curr) return NULL;
-    return iter->curr ? iter->curr->value : NULL;
+    rt_node **l = NODE_CHILD(n);
+    const unsigned char *k = NODE_BYTES(n);
+    int i;
+    switch(n->type) {
+    case NODE4:
+        for(i=0;i<n->lcnt;i++)
+            if(k[i] == c) return l+i;
+        return NULL;
+    case NODE16:
+        i = rt_bytes16_find(k,n->lcnt,c);
+        return i < 0 ? NULL : l+i;
+    case NODE48:
+        return k[c] ? l+k[c]-1 : NULL;
+    default:
+        return RT_LOAD(&l[c]) ? l+c : NULL;
+    }
 }
 
-/* Run a depth-first search (DFS) starting at node */
-void rt_node_dfs(rt_node *node, unsigned char *key, size_t klen,
-        void *usr_ctxt,
-        void (*mapfunc)(void *, unsigned char *, size_t, void *))
+static void *
+rt_mem_realloc(const rt_tree *t, void *p, size_t osz, size_t nsz)
 {
-    unsigned char *ptr = key+klen;
-    size_t len;
-    uint8_t child;
-    rt_node **next;
-    if(!node) return;
-
-    len = node->klen;
-    if(klen+len > MAX_KEY_LENGTH) len = MAX_KEY_LENGTH-klen;
-    memcpy(ptr,node->key,len);
-    ptr[len] = 0;
-    len += klen;
-    if(node->value) mapfunc(usr_ctxt, key, len, node->value);
-
-    for(child=0,next=node->leaf;child<node->lcnt;child++,next++)
-        rt_node_dfs(*next, key, len, usr_ctxt, mapfunc);
+    void *r;
+    if(!t->arena && t->realloc) return t->realloc(p,nsz);
+    if(t->arena && ALIGN_SIZE(osz) == ALIGN_SIZE(nsz)) return p;
+    r = rt_mem_alloc(t,nsz);
+    if(!r) return NULL;
+    memcpy(r,p,osz<nsz?osz:nsz);
+    rt_mem_free(t,p,osz);
+    return r;
 }
 
-void rt_tree_map(rt_tree *tree, void *usr_ctxt,
-        void (*mapfunc)(void *usr_ctxt, unsigned char *key,
-            size_t klen, void *value))
+static void
+rt_node_free(const rt_tree *t, rt_node *n)
 {
-    unsigned char key[MAX_KEY_LENGTH+1];
-    rt_node *n;
+    rt_node *l;
+    int c;
+    if(!n || !t) return;
+    NODE_FOREACH(n,c,l)
+        rt_node_free(t, l);
+    if(n->value && t->vfree) t->vfree(n->value);
+    rt_mem_free(t,n,n->asize);
+}
+
+/* Only release the values; the nodes go away with the arena slabs */
+static void
+rt_node_free_values(const rt_tree *t, rt_node *n)
+{
+    rt_node *l;
+    int c;
+    NODE_FOREACH(n,c,l)
+        rt_node_free_values(t, l);
+    if(n->value) t->vfree(n->value);
+}
+
+static size_t
+rt_node_size(uint8_t type, size_t keylen)
+{
+    return ALIGN_SIZE(sizeof(rt_node) + node_cap[type]*sizeof(rt_node *)
+            + node_nbytes[type] + keylen);
+}
+
+static rt_node *
+rt_node_new(const rt_tree *t, uint8_t type, const unsigned char *key,
+        size_t keylen)
+{
+    rt_node *n = NULL;
+    size_t sz;
+    if(!t || !t->malloc || keylen > NODE_KEY_MAX) return NULL;
+
+    sz = rt_node_size(type,keylen);
+    n = rt_mem_alloc(t,sz);
+    if(!n) return NULL;
+    memset(n,0,sz-keylen);
+    n->type = type;
+    n->klen = keylen;
+    n->asize = sz;
+    if(key && keylen>0)
+        memcpy(NODE_KEY(n),key,keylen);
+    return n;
+}
+
+static void
+rt_node_print(rt_node *n, int depth)
+{
+    int i, c;
+    rt_node *l;
+    for(i=0;i<depth;i++) printf("\t");
+    if(n)
+    {
+        if(n->klen) printf("\"%.*s\"",(int)n->klen,NODE_KEY(n));
+        else       printf("NULL");
+        if(n->value) printf(" = addr(%p)\n",n->value);
+        else         printf(" = NULL\n");
+        NODE_FOREACH(n,c,l) rt_node_print(l,depth+1);
+    } else printf("NULL\n");
+}
+
+static size_t
+_maxmatch(const unsigned char *key, const unsigned char *match, size_t len)
+{
+    register unsigned char *m1 = (unsigned char *)key,
+             *m2 = (unsigned char *)match;
+    unsigned char *me1 = m1+len, *me2 = m2+len;
+    while(m1<me1 && m2<me2 && *m1 == *m2) {
+        m1++; m2++;
+    }
+    return m1-key;
+}
+
+/* Return the slot referencing @a n: the parent child table or the root */
+static rt_node **
+rt_node_ref(const rt_tree *t, const rt_node *n)
+{
+    if(!n->parent) return (rt_node **)&t->root;
+    return rt_node_find(n->parent,NODE_KEY(n)[0]);
+}
+
+/*
+ * Lock @a n after its parent @a p, which holds it in the slot @a ref;
+ * for the root node, @a p is NULL and the root slot is locked instead.
+ * Fails if either node was replaced or unlinked since it was read, in
+ * which case the caller starts over. Without concurrent writers there
+ * is nothing to lock.
+ */
+static int
+rt_node_lock2(const rt_tree *t, rt_node *p, rt_node **ref, rt_node *n)
+{
+    uint32_t *pl;
+    if(!RT_SHARED(t)) return 1;
+    pl = p ? &p->lock : &t->epoch->root_lock;
+    if(!rt_lock(pl)) return 0;
+    if(RT_LOAD(ref) == n && rt_lock(&n->lock)) return 1;
+    rt_unlock(pl);
+    return 0;
+}
+
+static void
+rt_node_unlock2(const rt_tree *t, rt_node *p, rt_node *n)
+{
+    if(!RT_SHARED(t)) return;
+    rt_unlock(&n->lock);
+    rt_unlock(p ? &p->lock : &t->epoch->root_lock);
+}
+
+/*
+ * Copy @a n into a new node of kind @a type. The key of the copy is
+ * the @a plen bytes at @a pre followed by the key of @a n minus its
+ * first @a skip bytes. The children are shared with @a n; their parent
+ * pointers are only moved over by rt_node_replace.
+ */
+static rt_node *
+rt_node_copy(const rt_tree *t, const rt_node *n, uint8_t type,
+        const unsigned char *pre, size_t plen, size_t skip)
+{
+    rt_node *g, *l, **gl;
+    unsigned char *gk;
+    int c, i = 0;
+
+    g = rt_node_new(t,type,NULL,plen+n->klen-skip);
+    if(!g) return NULL;
+    if(plen) memcpy(NODE_KEY(g),pre,plen);
+    memcpy(NODE_KEY(g)+plen,NODE_KEY(n)+skip,n->klen-skip);
+    g->parent = n->parent;
+    g->value  = n->value;
+    g->lcnt   = n->lcnt;
+    if(RT_COUNTED(t)) g->count = n->count;
+    gl = NODE_CHILD(g);
+    gk = NODE_BYTES(g);
+    NODE_FOREACH(n,c,l) {
+        switch(type) {
+        case NODE4:
+        case NODE16:
+            gk[i] = c;
+            gl[i] = l;
+            break;
+        case NODE48:
+            gk[c] = i+1;
+            gl[i] = l;
+            break;
+        default:
+            gl[c] = l;
+        }
+        i++;
+    }
+    return g;
+}
+
+/* Point the children of @a g back at it */
+static void
+rt_node_adopt(rt_node *g)
+{
+    rt_node *l;
+    int c;
+    NODE_FOREACH(g,c,l)
+        RT_STORE(&l->parent,g);
+}
+
+/*
+ * Put the finished node @a g in place of the node referenced by @a ref
+ * and retire the old one. The children are patched before @a g is
+ * published, so readers never find it half built.
+ */
+static void
+rt_node_replace(const rt_tree *t, rt_node **ref, rt_node *g)
+{
+    rt_node *n = *ref;
+    rt_node_adopt(g);
+    RT_STORE(ref,g);
+    rt_node_retire(t,n);
+}
+
+/*
+ * Insert @a child into @a n, which must have room for it. Only NODE256
+ * takes a new child in a single store; the other kinds must not be
+ * visible to readers yet.
+ */
+static void
+rt_node_insert(rt_node *n, rt_node *child)
+{
+    rt_node **l = NODE_CHILD(n);
+    unsigned char *k = NODE_BYTES(n), c = NODE_KEY(child)[0];
+    int i;
+    switch(n->type) {
+    case NODE4:
+    case NODE16:
+        i = n->type==NODE16 ? rt_bytes16_lt(k,n->lcnt,c)
+                            : rt_bytes_lt(k,n->lcnt,c);
+        memmove(k+i+1,k+i,n->lcnt-i);
+        memmove(l+i+1,l+i,(n->lcnt-i)*sizeof(*l));
+        k[i] = c;
+        l[i] = child;
+        break;
+    case NODE48:
+        for(i=0;l[i];i++);
+        k[c] = i+1;
+        l[i] = child;
+        break;
+    default:
+        RT_STORE(&l[c],child);
+    }
+    RT_STORE(&child->parent,n);
+    n->lcnt++;
+}
+
+/*
+ * Add @a child to the node referenced by @a ref, promoting it if full.
+ * In concurrent mode only NODE256 is changed in place; for the other
+ * kinds the child goes into a copy, which then replaces the node.
+ */
+static int
+rt_node_add(const rt_tree *t, rt_node **ref, rt_node *child)
+{
+    rt_node *n = *ref, *g = n;
+    uint8_t type = n->type;
+
+    if(n->lcnt >= t->alsize) return 0;
+    if(n->lcnt >= node_cap[type]) type++;
+    if(type != n->type || (RT_SHARED(t) && type <= NODE48)) {
+        g = rt_node_copy(t,n,type,NULL,0,0);
+        if(!g) return 0;
+    }
+    rt_node_insert(g,child);
+    if(g != n) rt_node_replace(t,ref,g);
+    return 1;
+}
+
+/*
+ * Remove the child with discriminator byte @a c from the node
+ * referenced by @a ref, demoting the node if it becomes sparse. As in
+ * rt_node_add, concurrent mode only clears NODE256 slots in place.
+ * Returns 0 if the child could not be removed.
+ */
+static int
+rt_node_del(const rt_tree *t, rt_node **ref, unsigned char c)
+{
+    rt_node *n = *ref, *g = n, **l;
+    unsigned char *k;
+    uint8_t type = n->type;
+    int i;
+
+    if(!rt_node_find(n,c)) return 0;
+    if(type > NODE4 && n->lcnt-1 <= node_min[type]) type--;
+    if(type != n->type || (RT_SHARED(t) && type <= NODE48))
+        g = rt_node_copy(t,n,type,NULL,0,0);
+    if(!g) {
+        /* readers may be inside n, so it cannot be edited in place */
+        if(RT_SHARED(t) && n->type <= NODE48) return 0;
+        /* a failed demotion just leaves the node oversized */
+        g = n;
+        type = n->type;
+    }
+
+    l = NODE_CHILD(g);
+    k = NODE_BYTES(g);
+    switch(type) {
+    case NODE4:
+    case NODE16:
+        i = type==NODE16 ? rt_bytes16_find(k,g->lcnt,c)
+                         : rt_bytes_find(k,g->lcnt,c);
+        memmove(k+i,k+i+1,g->lcnt-i-1);
+        memmove(l+i,l+i+1,(g->lcnt-i-1)*sizeof(*l));
+        break;
+    case NODE48:
+        l[k[c]-1] = NULL;
+        k[c] = 0;
+        break;
+    default:
+        RT_STORE(&l[c],NULL);
+    }
+    g->lcnt--;
+    if(g != n) rt_node_replace(t,ref,g);
+    return 1;
+}
+
+/*
+ * Merge the valueless node referenced by @a ref with its only child:
+ * the child takes over the node key as a prefix of its own and replaces
+ * the node in its parent. This is the reverse of a split.
+ */
+static void
+rt_node_merge(const rt_tree *t, rt_node **ref)
+{
+    rt_node *n = *ref, *c, *l, *g;
+    size_t klen, sz;
+    int cc;
+
+    c = rt_node_next(n,-1,&cc);
+    if(RT_SHARED(t)) {
+        /* the child key cannot change under readers: merge a copy */
+        g = rt_node_copy(t,c,c->type,NODE_KEY(n),n->klen,0);
+        if(!g) return;
+        g->parent = n->parent;
+        rt_node_replace(t,ref,g);
+        rt_node_retire(t,c);
+        return;
+    }
+    klen = n->klen + c->klen;
+    if(klen > NODE_KEY_MAX) return;
+    sz = rt_node_size(c->type,klen);
+    if(sz > c->asize) {
+        g = rt_mem_realloc(t,c,c->asize,sz);
+        /* a failed merge just leaves the node chain in place */
+        if(!g) return;
+        g->asize = sz;
+        if(g != c) {
+            NODE_FOREACH(g,cc,l)
+                l->parent = g;
+            c = g;
+        }
+    }
+    memmove(NODE_KEY(c)+n->klen,NODE_KEY(c),c->klen);
+    memcpy(NODE_KEY(c),NODE_KEY(n),n->klen);
+    c->klen = klen;
+    c->parent = n->parent;
+    *ref = c;
+    rt_mem_free(t,n,n->asize);
+}
+
+/*
+ * rt_node_prune with concurrent writers. Each step locks the grand
+ * parent (or the root slot), the parent and the node itself, plus the
+ * only child for a merge, and checks under the locks that the node is
+ * still redundant. Pruning is best effort: it stops once the node was
+ * unlinked or replaced by another writer.
+ */
+static void
+rt_node_prune_shared(const rt_tree *t, rt_node *n)
+{
+    rt_node *p, *pp, *c, **pref, **ref;
+    int cc;
+
+    while((p = RT_LOAD(&n->parent))) {
+        pp = RT_LOAD(&p->parent);
+        pref = pp ? rt_node_find(pp,NODE_KEY(p)[0]) : (rt_node **)&t->root;
+        if(!pref || !rt_node_lock2(t,pp,pref,p)) goto retry;
+        ref = rt_node_find(p,NODE_KEY(n)[0]);
+        if(!ref || RT_LOAD(ref) != n || !rt_lock(&n->lock)) {
+            rt_node_unlock2(t,pp,p);
+            goto retry;
+        }
+
+        if(n->value || n->lcnt > 1) {
+            c = NULL;
+        } else if(n->lcnt == 1) {
+            /* the child cannot be replaced while n is locked */
+            c = rt_node_next(n,-1,&cc);
+            rt_lock(&c->lock);
+            rt_node_merge(t,ref);
+            rt_unlock(&c->lock);
+            c = NULL;
+        } else if(rt_node_del(t,pref,NODE_KEY(n)[0])) {
+            rt_node_retire(t,n);
+            c = RT_LOAD(pref);
+        } else {
+            c = NULL;
+        }
+        rt_unlock(&n->lock);
+        rt_node_unlock2(t,pp,p);
+        if(!c) return;
+        n = c;
+        continue;
+retry:
+        /* n itself went away; otherwise its parent was replaced */
+        if(__atomic_load_n(&n->lock,__ATOMIC_ACQUIRE) & OBSOLETE_BIT)
+            return;
+    }
+}
+
+/*
+ * Called once the value of @a n was cleared. Childless valueless nodes
+ * are unlinked from their parent (which may demote it), walking up as
+ * long as that leaves the parent redundant, and a valueless node with
+ * a single child is merged into it.
+ */
+static void
+rt_node_prune(const rt_tree *t, rt_node *n)
+{
+    rt_node **ref;
+    if(RT_SHARED(t)) {
+        rt_node_prune_shared(t,n);
+        return;
+    }
+    while(n->parent && !n->value) {
+        if(n->lcnt > 1) return;
+        if(n->lcnt == 1) {
+            rt_node_merge(t,rt_node_ref(t,n));
+            return;
+        }
+        ref = rt_node_ref(t,n->parent);
+        if(!rt_node_del(t,ref,NODE_KEY(n)[0])) return;
+        rt_node_retire(t,n);
+        n = *ref;
+    }
+}
+
+/*
+ * Read path
+ *
+ * Walk down from @a n consuming @a lkey bytes of @a key. The child is
+ * selected by the first key byte, so only the remaining bytes of the
+ * child key need comparing. Returns the node the key ends on, or NULL.
+ */
+static inline rt_node *
+rt_node_lookup(const rt_node *n, const unsigned char *key, size_t lkey)
+{
+    const unsigned char *end = key+lkey;
+    while(key < end) {
+        if(!(n = rt_node_child(n,*key))) return NULL;
+        if(n->klen > (size_t)(end-key)
+                || memcmp(NODE_KEY(n)+1,key+1,n->klen-1))
+            return NULL;
+        key += n->klen;
+    }
+    return (rt_node *)n;
+}
+
+/*
+ * Like rt_node_lookup, but the key may also end inside a node key; that
+ * node is the root of the subtree holding every key with prefix @a key.
+ * The length of the path to it goes to @a plen; its key is @a key
+ * followed by the last plen-lkey bytes of the node key.
+ */
+static rt_node *
+rt_node_prefix(const rt_node *n, const unsigned char *key, size_t lkey,
+        size_t *plen)
+{
+    const unsigned char *end = key+lkey;
+    size_t len, done = 0;
+    while(key < end) {
+        if(!(n = rt_node_child(n,*key))) return NULL;
+        len = (size_t)(end-key) < n->klen ? (size_t)(end-key) : n->klen;
+        if(memcmp(NODE_KEY(n)+1,key+1,len-1)) return NULL;
+        done += n->klen;
+        key += len;
+    }
+    *plen = done;
+    return (rt_node *)n;
+}
+
+/*
+ * Write path
+ *
+ * Find or create the node for @a key. Nodes are split and promoted on
+ * the way, each change locking just the node it replaces and its
+ * parent; if either changed since it was read, the walk starts over
+ * from the root. The returned node may be replaced again before the
+ * caller locks it, see rt_node_store.
+ */
+static rt_node *
+rt_node_set(const rt_tree *t, const unsigned char *key, size_t lkey)
+{
+    rt_node *parent, *n, *node, *split, *g, **ref, **p;
+    const unsigned char *k, *end = key+lkey;
+    size_t len, mm;
+    if(!key || lkey < 1) return NULL;
+
+restart:
+    parent = NULL;
+    ref = (rt_node **)&t->root;
+    n = RT_LOAD(ref);
+    k = key;
+    while(1) {
+        len = end-k;
+        p = rt_node_find(n,*k);
+        if(!p || !(node = RT_LOAD(p))) {
+            if(!rt_node_lock2(t,parent,ref,n)) goto restart;
+            if(RT_SHARED(t) && rt_node_find(n,*k)) {
+                /* another writer added the child meanwhile */
+                rt_node_unlock2(t,parent,n);
+                continue;
+            }
+            node = rt_node_new(t,NODE4,k,len<NODE_KEY_MAX?len:NODE_KEY_MAX);
+            if(node && !rt_node_add(t,ref,node)) {
+                rt_mem_free(t,node,node->asize);
+                node = NULL;
+            }
+            rt_node_unlock2(t,parent,n);
+            /* the rest of a very long key goes below node */
+            if(node && len > NODE_KEY_MAX) goto restart;
+            return node;
+        }
+
+        /* found (partial?) match */
+        mm = _maxmatch(k,NODE_KEY(node),node->klen < len ? node->klen : len);
+        if(mm < node->klen) {
+            /* split: insert a new node holding the common part of the
+             * key above node, and strip that part from node */
+            if(!rt_node_lock2(t,n,p,node)) goto restart;
+            split = rt_node_new(t,NODE4,NODE_KEY(node),mm);
+            g = node;
+            if(split && RT_SHARED(t)) {
+                /* readers may be inside node: strip a copy instead */
+                g = rt_node_copy(t,node,node->type,NULL,0,mm);
+                if(!g) {
+                    rt_mem_free(t,split,split->asize);
+                    split = NULL;
+                }
+            } else if(split) {
+                memmove(NODE_KEY(node),NODE_KEY(node)+mm,node->klen-mm);
+                node->klen -= mm;
+            }
+            if(!split) {
+                /* failed to split and add child node */
+                rt_node_unlock2(t,n,node);
+                return NULL;
+            }
+            split->parent = node->parent;
+            if(RT_COUNTED(t)) split->count = g->count;
+            rt_node_insert(split,g);
+            /* adopt only now: iterators climbing out of the children
+             * must find split complete above g */
+            if(g != node) rt_node_adopt(g);
+            RT_STORE(p,split);
+            if(g != node) rt_node_retire(t,node);
+            rt_node_unlock2(t,n,node);
+            node = split;
+        }
+        if(mm==len) return node;
+        parent = n;
+        ref = p;
+        n = node;
+        k += mm;
+    }
+}
+
+/* Add @a d to the value counts of @a n and the nodes above it */
+static void
+rt_node_count(rt_node *n, int d)
+{
+    for(;n;n=n->parent)
+        n->count += d;
+}
+
+/*
+ * Store @a value in the node @a n returned by rt_node_set, or only
+ * return its current value if @a keep is set and there is one. Returns
+ * NULL if @a n was replaced in the meantime; the caller then looks it
+ * up again.
+ */
+static void *
+rt_node_store(const rt_tree *t, rt_node *n, void *value, int keep)
+{
+    if(RT_SHARED(t) && !rt_lock(&n->lock)) return NULL;
+    if(RT_COUNTED(t) && !n->value) rt_node_count(n,1);
+    if(!keep || !n->value) RT_STORE(&n->value,value);
+    value = n->value;
+    if(RT_SHARED(t)) rt_unlock(&n->lock);
+    return value;
+}
+
+static rt_tree *
+rt_tree_init(   unsigned int albet_size,
+        void (*_vfree)(void*),
+        void* (*_malloc)(size_t),
+        void* (*_realloc)(void *,size_t),
+        void (*_free)(void*),
+        unsigned int flags)
+{
+    rt_tree *t = NULL;
+    if(!_malloc || !_free || albet_size<1) return NULL;
+    /* the counts live in the lock words */
+    if((flags & RT_FLAG_COUNT) && (flags & RT_FLAG_CONCURRENT)) return NULL;
+    t = _malloc(sizeof(rt_tree));
+    if(!t) return NULL;
+    t->malloc = _malloc;
+    t->realloc = _realloc;
+    t->free = _free;
+    t->vfree = _vfree;
+    t->flags = flags;
+    t->alsize = albet_size>MAX_ALPHABET_SIZE ? MAX_ALPHABET_SIZE:albet_size;
+    t->arena = NULL;
+    t->epoch = NULL;
+    if(flags & RT_FLAG_ARENA) {
+        t->arena = _malloc(sizeof(rt_arena));
+        if(!t->arena) goto fail;
+        memset(t->arena,0,sizeof(rt_arena));
+    }
+    if(flags & RT_FLAG_CONCURRENT) {
+        t->epoch = _malloc(sizeof(rt_epoch));
+        if(!t->epoch) goto fail;
+        memset(t->epoch,0,sizeof(rt_epoch));
+        t->epoch->epoch = 1;
+    }
+    t->root = rt_node_new(t,NODE4,NULL,0);
+    if(!t->root) goto fail;
+    t->root->parent = NULL;
+    return t;
+fail:
+    if(t->epoch) _free(t->epoch);
+    if(t->arena) rt_arena_release(t);
+    _free(t);
+    return NULL;
+}
+
+rt_tree *
+rt_tree_new(unsigned int albet_size, void (*_vfree)(void*))
+{
+    return rt_tree_init(albet_size, _vfree, malloc, realloc, free, 0);
+}
+
+rt_tree *
+rt_tree_new_flags(unsigned int albet_size, void (*_vfree)(void*),
+        unsigned int flags)
+{
+    return rt_tree_init(albet_size, _vfree, malloc, realloc, free, flags);
+}
+
+rt_tree *
+rt_tree_malloc( unsigned int albet_size,
+        void (*_vfree)(void*),
+        void* (*_malloc)(size_t),
+        void* (*_realloc)(void *,size_t),
+        void (*_free)(void*))
+{
+    return rt_tree_init(albet_size, _vfree, _malloc, _realloc, _free, 0);
+}
+
+void
+rt_tree_free(rt_tree *t)
+{
+    size_t i;
+    if(!t) return;
+    if(t->epoch) {
+        /* retired nodes share their values with the live ones */
+        for(i=0;i<t->epoch->nretired && !t->arena;i++)
+            rt_mem_free(t,t->epoch->retired[i].p,t->epoch->retired[i].size);
+        if(t->epoch->retired) t->free(t->epoch->retired);
+        t->free(t->epoch);
+    }
+    if(t->arena) {
+        if(t->vfree) rt_node_free_values(t,t->root);
+        rt_arena_release(t);
+    } else rt_node_free(t,t->root);
+    t->free(t);
+}
+
+void *
+rt_tree_get(const rt_tree *t, const unsigned char *key, size_t lkey)
+{
+    rt_node *n;
+    void *value = NULL;
+    int slot;
+    if(!t || !key || lkey < 1) return NULL;
+    slot = rt_epoch_enter(t);
+    n = rt_node_lookup(RT_LOAD(&t->root),key,lkey);
+    if(n) value = RT_LOAD(&n->value);
+    rt_epoch_exit(t,slot);
+    return value;
+}
+
+/*
+ * The walk of rt_node_lookup, remembering the last node on the way
+ * that has a value: the cost is one lookup, however many of the
+ * shorter keys are in the tree.
+ */
+void *
+rt_tree_longest_prefix(const rt_tree *t, const unsigned char *key,
+        size_t lkey, size_t *matched)
+{
+    const rt_node *n;
+    const unsigned char *k = key, *end = key+lkey;
+    void *value, *best = NULL;
+    size_t blen = 0;
+    int slot;
+    if(t && key) {
+        slot = rt_epoch_enter(t);
+        n = RT_LOAD(&t->root);
+        while(k < end && (n = rt_node_child(n,*k))) {
+            if(n->klen > (size_t)(end-k)
+                    || memcmp(NODE_KEY(n)+1,k+1,n->klen-1))
+                break;
+            k += n->klen;
+            if((value = RT_LOAD(&n->value))) {
+                best = value;
+                blen = k-key;
+            }
+        }
+        rt_epoch_exit(t,slot);
+    }
+    if(matched) *matched = blen;
+    return best;
+}
+
+void
+rt_tree_synchronize(rt_tree *t)
+{
+    uint64_t min;
+    if(!t || !t->epoch) return;
+    min = rt_epoch_advance(t,1);
+    rt_lock(&t->epoch->retire_lock);
+    rt_epoch_free(t,min);
+    rt_unlock(&t->epoch->retire_lock);
+}
+
+/*
+ * Batched lookups
+ *
+ * Up to BATCH_WINDOW lookups are in flight at once. Each visit advances
+ * one lookup by a single node: it checks the key of the node that was
+ * prefetched on the previous visit, selects the next child, prefetches
+ * it and moves on to the next lookup. The cache misses of independent
+ * lookups thus overlap instead of being paid one after the other.
+ */
+
+#define BATCH_WINDOW 16
+
+#ifdef __GNUC__
+#define RT_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define RT_PREFETCH(p)
+#endif
+
+typedef struct {
+    const rt_node *node;        /* child to check next; NULL if done */
+    const unsigned char *key;   /* remaining key, starting at node */
+    const unsigned char *end;
+    size_t index;               /* output slot */
+} rt_batch_state;
+
+/* Select the child for the next key byte and prefetch it */
+static inline void
+rt_batch_descend(rt_batch_state *b, const rt_node *n, void **out)
+{
+    rt_node *p;
+    if(b->key >= b->end) {
+        out[b->index] = RT_LOAD(&n->value);
+        b->node = NULL;
+    } else if(!(p = rt_node_child(n,*b->key))) {
+        out[b->index] = NULL;
+        b->node = NULL;
+    } else {
+        b->node = p;
+        RT_PREFETCH(b->node);
+        RT_PREFETCH((const char *)b->node+64);
+    }
+}
+
+/* Start lookup @a i in @a b; returns 0 if it finished right away */
+static int
+rt_batch_start(const rt_tree *t, rt_batch_state *b, size_t i,
+        const unsigned char **keys, const size_t *lens, void **out)
+{
+    b->index = i;
+    if(!keys[i] || lens[i] < 1) {
+        out[i] = NULL;
+        return 0;
+    }
+    b->key = keys[i];
+    b->end = keys[i] + lens[i];
+    rt_batch_descend(b,RT_LOAD(&t->root),out);
+    return b->node != NULL;
+}
+
+void
+rt_tree_get_batch(const rt_tree *t, const unsigned char **keys,
+        const size_t *lens, size_t n, void **out)
+{
+    rt_batch_state win[BATCH_WINDOW], *b;
+    size_t next = 0, active = 0, i;
+    const rt_node *c;
+    int slot;
+    if(!out) return;
+    if(!t || !keys || !lens) {
+        for(i=0;i<n;i++) out[i] = NULL;
+        return;
+    }
+    slot = rt_epoch_enter(t);
+
+    /* fill the window */
+    while(active < BATCH_WINDOW && next < n)
+        if(rt_batch_start(t,&win[active],next++,keys,lens,out)) active++;
+
+    while(active > 0) {
+        for(i=0;i<active;i++) {
+            b = &win[i];
+            c = b->node;
+            if(c->klen > (size_t)(b->end-b->key)
+                    || memcmp(NODE_KEY(c)+1,b->key+1,c->klen-1)) {
+                out[b->index] = NULL;
+                b->node = NULL;
+            } else {
+                b->key += c->klen;
+                rt_batch_descend(b,c,out);
+            }
+            if(b->node) continue;
+
+            /* refill the finished slot, or compact the window */
+            while(next < n && !rt_batch_start(t,b,next,keys,lens,out))
+                next++;
+            if(next < n) {
+                next++;
+            } else {
+                win[i--] = win[--active];
+            }
+        }
+    }
+    rt_epoch_exit(t,slot);
+}
+
+int
+rt_tree_set(rt_tree *t, const unsigned char *key,
+        size_t lkey, void *value)
+{
+    rt_node *n;
+    int slot;
+    /* rt_node_set will add the key, don't do this if value==NULL */
+    if(!t || !value) return 0;
+    slot = rt_epoch_enter(t);
+    do {
+        n = rt_node_set(t,key,lkey);
+    } while(n && !rt_node_store(t,n,value,0));
+    rt_epoch_exit(t,slot);
+    return n != NULL;
+}
+
+void *
+rt_tree_setdefault(rt_tree *t, const unsigned char *key,
+        size_t lkey, void *value)
+{
+    rt_node *n;
+    void *old = NULL;
+    int slot;
+    /* rt_node_set will add the key, don't do this if value==NULL */
+    if(!t || !value) return NULL;
+    slot = rt_epoch_enter(t);
+    do {
+        n = rt_node_set(t,key,lkey);
+    } while(n && !(old = rt_node_store(t,n,value,1)));
+    rt_epoch_exit(t,slot);
+    return old;
+}
+
+/*
+ * Bulk loading
+ *
+ * rt_node_build creates the node for the sorted key range [lo,hi), all
+ * of which share their first @a d bytes. Because the range is sorted,
+ * its common prefix is the one of its first and last key, and keys
+ * equal to that prefix come first. The children are the runs of keys
+ * with the same next byte, so the node can be allocated once with its
+ * final kind and key length.
+ */
+
+/* Free a partially built subtree; the values still belong to the caller */
+static void
+rt_node_discard(const rt_tree *t, rt_node *n)
+{
+    rt_node *l;
+    int c;
+    NODE_FOREACH(n,c,l)
+        rt_node_discard(t,l);
+    rt_mem_free(t,n,n->asize);
+}
+
+static rt_node *
+rt_node_build(const rt_tree *t, const unsigned char **keys,
+        const size_t *lens, void **values, size_t lo, size_t hi,
+        size_t d, int root)
+{
+    rt_node *n, *c;
+    size_t lcp = d, end, i, j, fanout = 0;
+    void *value = NULL;
+    uint8_t type = NODE4;
+
+    if(!root) {
+        end = lens[lo] < lens[hi-1] ? lens[lo] : lens[hi-1];
+        while(lcp < end && keys[lo][lcp] == keys[hi-1][lcp]) lcp++;
+    }
+    /* duplicate keys: the last one wins, as with rt_tree_set */
+    for(i=lo;i<hi && lens[i]==lcp;i++)
+        value = values[i];
+    for(j=i;j<hi;fanout++)
+        for(end=j;j<hi && keys[j][lcp]==keys[end][lcp];j++);
+
+    if(fanout > t->alsize) return NULL;
+    while(node_cap[type] < fanout) type++;
+    n = rt_node_new(t,type,keys[lo]+d,lcp-d);
+    if(!n) return NULL;
+    n->value = value;
+    if(RT_COUNTED(t)) n->count = value != NULL;
+    for(j=i;j<hi;j=i) {
+        for(i=j;i<hi && keys[i][lcp]==keys[j][lcp];i++);
+        c = rt_node_build(t,keys,lens,values,j,i,lcp,0);
+        if(!c) {
+            rt_node_discard(t,n);
+            return NULL;
+        }
+        rt_node_insert(n,c);
+        if(RT_COUNTED(t)) n->count += c->count;
+    }
+    return n;
+}
+
+static int
+rt_key_cmp(const unsigned char *k1, size_t l1,
+        const unsigned char *k2, size_t l2)
+{
+    int cmp = memcmp(k1,k2,l1<l2?l1:l2);
+    if(cmp) return cmp;
+    return l1<l2 ? -1 : l1>l2;
+}
+
+int
+rt_tree_build_sorted(rt_tree *t, const unsigned char **keys,
+        const size_t *lens, void **values, size_t n)
+{
+    rt_node *root, *old;
+    size_t i;
+    int slot;
+    if(!t || !t->root || t->root->lcnt > 0 || !keys || !lens || !values)
+        return 0;
+    for(i=0;i<n;i++) {
+        if(!keys[i] || lens[i] < 1 || !values[i]) return 0;
+        if(i > 0 && rt_key_cmp(keys[i-1],lens[i-1],keys[i],lens[i]) > 0)
+            return 0;
+    }
+    if(n == 0) return 1;
+
+    root = rt_node_build(t,keys,lens,values,0,n,0,1);
+    if(!root) return 0;
+    slot = rt_epoch_enter(t);
+    do {
+        old = RT_LOAD(&t->root);
+    } while(!rt_node_lock2(t,NULL,(rt_node **)&t->root,old));
+    /* other writers may have filled the tree meanwhile */
+    if(old->lcnt > 0) {
+        rt_node_unlock2(t,NULL,old);
+        rt_epoch_exit(t,slot);
+        rt_node_discard(t,root);
+        return 0;
+    }
+    RT_STORE(&t->root,root);
+    rt_node_retire(t,old);
+    rt_node_unlock2(t,NULL,old);
+    rt_epoch_exit(t,slot);
+    return 1;
+}
+
+typedef struct {
+    const unsigned char *key;
+    size_t len;
+    void *value;
+    size_t index;
+} rt_build_entry;
+
+static int
+rt_build_cmp(const void *a, const void *b)
+{
+    const rt_build_entry *e1 = a, *e2 = b;
+    int cmp = rt_key_cmp(e1->key,e1->len,e2->key,e2->len);
+    if(cmp) return cmp;
+    /* keep duplicates in input order so that the last one wins */
+    return e1->index < e2->index ? -1 : e1->index > e2->index;
+}
+
+int
+rt_tree_build(rt_tree *t, const unsigned char **keys,
+        const size_t *lens, void **values, size_t n)
+{
+    rt_build_entry *e;
+    const unsigned char **skeys;
+    size_t *slens, i;
+    void **svalues;
+    int ret = 0;
+    if(!t || !keys || !lens || !values) return 0;
+    if(n == 0) return rt_tree_build_sorted(t,keys,lens,values,n);
+
+    e = t->malloc(n*sizeof(*e));
+    skeys = t->malloc(n*sizeof(*skeys));
+    slens = t->malloc(n*sizeof(*slens));
+    svalues = t->malloc(n*sizeof(*svalues));
+    if(e && skeys && slens && svalues) {
+        for(i=0;i<n;i++) {
+            e[i].key = keys[i];
+            e[i].len = lens[i];
+            e[i].value = values[i];
+            e[i].index = i;
+            if(!keys[i]) goto done;
+        }
+        qsort(e,n,sizeof(*e),rt_build_cmp);
+        for(i=0;i<n;i++) {
+            skeys[i] = e[i].key;
+            slens[i] = e[i].len;
+            svalues[i] = e[i].value;
+        }
+        ret = rt_tree_build_sorted(t,skeys,slens,svalues,n);
+    }
+done:
+    if(e) t->free(e);
+    if(skeys) t->free(skeys);
+    if(slens) t->free(slens);
+    if(svalues) t->free(svalues);
+    return ret;
+}
+
+int
+rt_tree_remove(rt_tree *t, const unsigned char *key, size_t lkey)
+{
+    rt_node *n;
+    int slot, ret = 0;
+    if(!t || !key || lkey < 1) return 0;
+    slot = rt_epoch_enter(t);
+    do {
+        n = rt_node_lookup(RT_LOAD(&t->root),key,lkey);
+        /* retry if a concurrent writer replaced n */
+    } while(n && RT_SHARED(t) && !rt_lock(&n->lock));
+
+    if(n && n->value) {
+        RT_STORE(&n->value,NULL);
+        if(RT_COUNTED(t)) rt_node_count(n,-1);
+        ret = 1;
+    }
+    if(n && RT_SHARED(t)) rt_unlock(&n->lock);
+    if(ret) rt_node_prune(t,n);
+    rt_epoch_exit(t,slot);
+    return ret;
+}
+
+void
+rt_tree_print(const rt_tree *t)
+{
+    int c;
+    rt_node *l;
+    if(!t || !t->root) printf("NULL");
+    NODE_FOREACH(t->root,c,l) rt_node_print(l,0);
+}
+
+/* rt_iter_init storage must fit any iterator, see RT_ITER_SIZE */
+typedef char rt_iter_size_check[sizeof(rt_iter) <= RT_ITER_SIZE ? 1 : -1];
+
+size_t
+rt_iter_size(void)
+{
+    return sizeof(rt_iter);
+}
+
+rt_iter *
+rt_tree_prefix(const rt_tree *t, const unsigned char *prefix,
+        size_t prefixlen)
+{
+    rt_iter *iter;
+    if(!t) return NULL;
+
+    iter = t->malloc(sizeof(*iter));
+    if(!iter) return NULL;
+    rt_iter_init(iter,t,prefix,prefixlen);
+    iter->free = t->free;
+    return iter;
+}
+
+rt_iter *
+rt_iter_init(void *storage, const rt_tree *t, const unsigned char *prefix,
+        size_t prefixlen)
+{
+    rt_iter *iter = storage;
+    rt_node *result = NULL;
+    size_t klen = 0;
+    if(!iter || !t) return NULL;
+
+    iter->curr = NULL;
+    iter->t = t;
+    iter->free = NULL;
+    iter->depth = 0;
+    iter->klen = 0;
+    iter->stack = iter->istack;
+    iter->scap = RT_ITER_DEPTH;
+    iter->key = iter->ikey;
+    iter->kcap = RT_ITER_KEYLEN;
+    iter->start = NULL;
+    iter->end = NULL;
+    iter->slen = iter->elen = 0;
+    iter->desc = 0;
+
+    /* the iterator keeps its nodes pinned until rt_iter_free */
+    iter->slot = rt_epoch_enter(t);
+    if(!prefix || prefixlen < 1)
+        result = RT_LOAD(&t->root);
+    else if((result = rt_node_prefix(RT_LOAD(&t->root),prefix,prefixlen,
+                    &klen))) {
+        if(!(iter->key = rt_grow(iter->key,&iter->kcap,klen+1,1,
+                        iter->ikey,t->malloc,t->free))) {
+            iter->key = iter->ikey;
+            result = NULL;
+        } else {
+            memcpy(iter->key,prefix,prefixlen);
+            memcpy(iter->key+prefixlen,
+                    NODE_KEY(result)+result->klen-(klen-prefixlen),
+                    klen-prefixlen);
+        }
+    }
+    if(result) {
+        iter->stack[0].node = result;
+        iter->stack[0].c = -1;
+        iter->stack[0].klen = klen;
+        iter->depth = 1;
+    }
+    return iter;
+}
+
+void
+rt_iter_free(rt_iter *iter)
+{
+    if(!iter) return;
+    rt_epoch_exit(iter->t,iter->slot);
+    if(iter->stack != iter->istack) iter->t->free(iter->stack);
+    if(iter->key != iter->ikey) iter->t->free(iter->key);
+    if(iter->start) iter->t->free(iter->start);
+    if(iter->end) iter->t->free(iter->end);
+    if(iter->free) iter->free(iter);
+}
+
+/*
+ * The iterator keeps the path from its root to the current node on a
+ * stack, with the child each node was left through, and the key of the
+ * current node in its key buffer. Each step so only looks at the nodes
+ * it enters or leaves; nodes a concurrent writer replaced meanwhile are
+ * finished as they were. Subtrees the stack or key buffer cannot grow
+ * for are skipped.
+ */
+
+/* Push @a n, a child of the top node, with its key; 0 if out of memory */
+static int
+rt_iter_push(rt_iter *iter, const rt_node *n)
+{
+    const rt_tree *t = iter->t;
+    rt_iter_frame *stack;
+    unsigned char *key;
+    size_t klen = iter->depth ? iter->stack[iter->depth-1].klen : 0;
+    if(klen+n->klen >= iter->kcap) {
+        if(!(key = rt_grow(iter->key,&iter->kcap,klen+n->klen+1,1,
+                        iter->ikey,t->malloc,t->free)))
+            return 0;
+        iter->key = key;
+    }
+    if(iter->depth == iter->scap) {
+        if(!(stack = rt_grow(iter->stack,&iter->scap,iter->depth+1,
+                        sizeof(*stack),iter->istack,t->malloc,t->free)))
+            return 0;
+        iter->stack = stack;
+    }
+    memcpy(iter->key+klen,NODE_KEY(n),n->klen);
+    iter->stack[iter->depth].node = n;
+    iter->stack[iter->depth].c = -1;
+    iter->stack[iter->depth].klen = klen+n->klen;
+    iter->depth++;
+    return 1;
+}
+
+/* Pop the top node, so that the parent visits it again next */
+static void
+rt_iter_pop(rt_iter *iter)
+{
+    if(--iter->depth > 0) iter->stack[iter->depth-1].c--;
+}
+
+/*
+ * Make the top node current, reached going @a back or forward. A key
+ * outside the range is not: the iterator stays on the inside of it.
+ */
+static int
+rt_iter_emit(rt_iter *iter, void *value, int back)
+{
+    iter->curr = iter->stack[iter->depth-1].node;
+    iter->value = value;
+    iter->klen = iter->stack[iter->depth-1].klen;
+    iter->key[iter->klen] = 0;
+    if(back ? iter->start && rt_key_cmp(iter->key,iter->klen,
+                iter->start,iter->slen) < 0
+            : iter->end && rt_key_cmp(iter->key,iter->klen,
+                iter->end,iter->elen) >= 0) {
+        iter->value = NULL;
+        if(!back && iter->depth > 1) rt_iter_pop(iter);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Step forward. At the end the iterator stays behind the last child of
+ * its root, so that rt_iter_back can turn around there.
+ */
+static int
+rt_iter_fwd(rt_iter *iter)
+{
+    const rt_node *n;
+    void *value;
+    int cc;
+    if(iter->depth == 0) return 0;
+
+    /* the subtree root itself comes first */
+    if(!iter->curr) {
+        n = iter->stack[0].node;
+        iter->curr = n;
+        if((value = RT_LOAD(&n->value))) return rt_iter_emit(iter,value,0);
+    }
+    while(1) {
+        n = rt_node_next(iter->stack[iter->depth-1].node,
+                iter->stack[iter->depth-1].c,&cc);
+        if(!n) {
+            if(iter->depth == 1) break;
+            iter->depth--;
+            continue;
+        }
+        iter->stack[iter->depth-1].c = cc;
+        if(!rt_iter_push(iter,n)) continue;
+        if((value = RT_LOAD(&n->value))) return rt_iter_emit(iter,value,0);
+    }
+    iter->stack[0].c = 255;
+    return 0;
+}
+
+/*
+ * Step back to the last key before the current position, in the mirror
+ * image of rt_iter_fwd: the last child left of the position is entered
+ * from its end, and a node comes after all of its children. At the
+ * start the iterator is left as a fresh one, with no current node.
+ */
+static int
+rt_iter_back(rt_iter *iter)
+{
+    rt_iter_frame *f;
+    const rt_node *n;
+    void *value;
+    int cc;
+    if(iter->depth == 0 || !iter->curr) return 0;
+
+    /* step off the current node */
+    f = &iter->stack[iter->depth-1];
+    if(iter->value && f->c < 0 && f->node == iter->curr) {
+        if(iter->depth == 1) goto start;
+        rt_iter_pop(iter);
+    }
+    while(1) {
+        f = &iter->stack[iter->depth-1];
+        if((n = rt_node_prev(f->node,f->c+1,&cc))) {
+            f->c = cc;
+            if(rt_iter_push(iter,n)) iter->stack[iter->depth-1].c = 255;
+            else f->c = cc-1;
+            continue;
+        }
+        f->c = -1;
+        if((value = RT_LOAD(&f->node->value)))
+            return rt_iter_emit(iter,value,1);
+        if(iter->depth == 1) break;
+        rt_iter_pop(iter);
+    }
+start:
+    iter->stack[0].c = -1;
+    iter->curr = NULL;
+    iter->value = NULL;
+    return 0;
+}
+
+int
+rt_iter_next(rt_iter *iter)
+{
+    if(!iter) return 0;
+    return iter->desc ? rt_iter_back(iter) : rt_iter_fwd(iter);
+}
+
+int
+rt_iter_prev(rt_iter *iter)
+{
+    if(!iter) return 0;
+    return iter->desc ? rt_iter_fwd(iter) : rt_iter_back(iter);
+}
+
+/* Place a fresh iterator behind its last key, for RT_ITER_DESC */
+static void
+rt_iter_reverse(rt_iter *iter)
+{
+    iter->desc = 1;
+    if(iter->depth == 0) return;
+    iter->stack[0].c = 255;
+    iter->curr = iter->stack[0].node;
+}
+
+rt_iter *
+rt_tree_prefix_flags(const rt_tree *t, const unsigned char *prefix,
+        size_t prefixlen, unsigned int flags)
+{
+    rt_iter *iter = rt_tree_prefix(t,prefix,prefixlen);
+    if(iter && (flags & RT_ITER_DESC)) rt_iter_reverse(iter);
+    return iter;
+}
+
+/*
+ * Position @a iter in front of the first key greater than or equal to
+ * @a key (greater than, with @a strict), walking down its path once:
+ * each node on the path is left through the child before the next key
+ * byte, and the walk ends where the path leaves the tree.
+ */
+static int
+rt_iter_seek(rt_iter *iter, const unsigned char *key, size_t lkey,
+        int strict)
+{
+    const rt_node *n, *c;
+    size_t d = 0, m, len;
+
+    iter->depth = 0;
+    iter->value = NULL;
+    n = RT_LOAD(&iter->t->root);
+    if(!rt_iter_push(iter,n)) return 0;
+    /* the root has no value; go straight to the children */
+    iter->curr = n;
+    while(d < lkey) {
+        iter->stack[iter->depth-1].c = key[d]-1;
+        if(!(c = rt_node_child(n,key[d]))) return 1;
+        len = lkey-d < c->klen ? lkey-d : c->klen;
+        m = _maxmatch(key+d,NODE_KEY(c),len);
+        if(m < c->klen) {
+            /* the keys below c are all greater, or all less */
+            if(m < len && NODE_KEY(c)[m] < key[d+m])
+                iter->stack[iter->depth-1].c = key[d];
+            return 1;
+        }
+        iter->stack[iter->depth-1].c = key[d];
+        if(!rt_iter_push(iter,c)) return 0;
+        n = c;
+        d += m;
+    }
+    /* n holds key itself: visit it again unless strict */
+    if(!strict && iter->depth > 1) rt_iter_pop(iter);
+    return 1;
+}
+
+/*
+ * Every mode starts from the position in front of the first key after
+ * @a key (RT_SEEK_GT, RT_SEEK_LE) or at it (RT_SEEK_GE, RT_SEEK_LT),
+ * which the key of the mode is either right after or right before. The
+ * iterator is then moved onto that key and back off it on the side it
+ * is read from.
+ */
+rt_iter *
+rt_tree_seek(const rt_tree *t, const unsigned char *key, size_t lkey,
+        int mode)
+{
+    rt_iter *iter;
+    int desc = (mode & RT_ITER_DESC) != 0, found = 1;
+    mode &= ~RT_ITER_DESC;
+    if(!t || (!key && lkey > 0) || mode < RT_SEEK_GE || mode > RT_SEEK_LT)
+        return NULL;
+    iter = rt_tree_prefix(t,NULL,0);
+    if(!iter) return NULL;
+    if(!rt_iter_seek(iter,key,lkey,mode==RT_SEEK_GT || mode==RT_SEEK_LE)) {
+        rt_iter_free(iter);
+        return NULL;
+    }
+    if(!desc && (mode == RT_SEEK_LE || mode == RT_SEEK_LT)) {
+        if((found = rt_iter_back(iter))) rt_iter_pop(iter);
+    } else if(desc && (mode == RT_SEEK_GE || mode == RT_SEEK_GT)) {
+        /* behind the key, but not on it: back yields it first */
+        found = rt_iter_fwd(iter);
+    }
+    iter->value = NULL;
+    iter->desc = desc;
+    /* no key for the mode: nothing to iterate */
+    if(!found) iter->depth = 0;
+    return iter;
+}
+
+/* Copy a range bound; the caller's key need not outlive the iterator */
+static unsigned char *
+rt_iter_bound(const rt_tree *t, const unsigned char *key, size_t len)
+{
+    unsigned char *r = t->malloc(len ? len : 1);
+    if(r) memcpy(r,key,len);
+    return r;
+}
+
+rt_iter *
+rt_tree_range(const rt_tree *t, const unsigned char *lo, size_t llo,
+        const unsigned char *hi, size_t lhi)
+{
+    rt_iter *iter;
+    if(!t || (!lo && llo > 0) || (!hi && lhi > 0)) return NULL;
+    iter = rt_tree_seek(t,lo,llo,RT_SEEK_GE);
+    if(!iter) return NULL;
+    /* rt_iter_prev stops at lo, rt_iter_next at hi */
+    if((llo && !(iter->start = rt_iter_bound(t,lo,llo)))
+            || (hi && !(iter->end = rt_iter_bound(t,hi,lhi)))) {
+        rt_iter_free(iter);
+        return NULL;
+    }
+    iter->slen = llo;
+    iter->elen = lhi;
+    return iter;
+}
+
+/*
+ * Counting
+ *
+ * With RT_FLAG_COUNT every node knows how many values its subtree
+ * holds, so a prefix is counted by finding its subtree, and the keys
+ * before a key by adding up the subtrees left of its path. Without it,
+ * the subtrees are counted as they are met.
+ */
+static size_t
+rt_node_nkeys(const rt_tree *t, const rt_node *n)
+{
+    const rt_node *l;
+    size_t r;
+    int c;
+    if(RT_COUNTED(t)) return n->count;
+    r = RT_LOAD(&n->value) != NULL;
+    NODE_FOREACH(n,c,l)
+        r += rt_node_nkeys(t,l);
+    return r;
+}
+
+size_t
+rt_tree_count_prefix(const rt_tree *t, const unsigned char *prefix,
+        size_t prefixlen)
+{
+    const rt_node *n;
+    size_t r = 0, len;
+    int slot;
+    if(!t || (!prefix && prefixlen > 0)) return 0;
+    slot = rt_epoch_enter(t);
+    n = RT_LOAD(&t->root);
+    if(prefixlen > 0) n = rt_node_prefix(n,prefix,prefixlen,&len);
+    if(n) r = rt_node_nkeys(t,n);
+    rt_epoch_exit(t,slot);
+    return r;
+}
+
+size_t
+rt_tree_rank(const rt_tree *t, const unsigned char *key, size_t lkey)
+{
+    const rt_node *n, *c;
+    size_t r = 0, d = 0, m, len;
+    int cc, slot;
+    if(!t || (!key && lkey > 0)) return 0;
+    slot = rt_epoch_enter(t);
+    n = RT_LOAD(&t->root);
+    while(d < lkey) {
+        /* n holds a proper prefix of key */
+        if(RT_LOAD(&n->value)) r++;
+        NODE_FOREACH(n,cc,c) {
+            if(cc >= key[d]) break;
+            r += rt_node_nkeys(t,c);
+        }
+        if(!c || cc != key[d]) break;
+        len = lkey-d < c->klen ? lkey-d : c->klen;
+        m = _maxmatch(key+d,NODE_KEY(c),len);
+        if(m < c->klen) {
+            /* the keys below c are all less, or all greater */
+            if(m < len && NODE_KEY(c)[m] < key[d+m])
+                r += rt_node_nkeys(t,c);
+            break;
+        }
+        n = c;
+        d += m;
+    }
+    rt_epoch_exit(t,slot);
+    return r;
+}
+
+/*
+ * Walk down to the key of rank @a k, skipping the subtrees before it,
+ * and leave the iterator in front of it as rt_iter_seek does
+ */
+rt_iter *
+rt_tree_select(const rt_tree *t, size_t k)
+{
+    rt_iter *iter;
+    const rt_node *n, *c;
+    size_t m;
+    int cc;
+    iter = rt_tree_prefix(t,NULL,0);
+    if(!iter || iter->depth == 0) return iter;
+    n = iter->curr = iter->stack[0].node;
+    while(1) {
+        if(RT_LOAD(&n->value) && k-- == 0) {
+            rt_iter_pop(iter);
+            return iter;
+        }
+        NODE_FOREACH(n,cc,c) {
+            if(k < (m = rt_node_nkeys(t,c))) break;
+            k -= m;
+        }
+        if(!c) break;
+        iter->stack[iter->depth-1].c = cc;
+        if(!rt_iter_push(iter,c)) break;
+        n = c;
+    }
+    /* there are no k+1 keys: nothing to iterate */
+    iter->depth = 0;
+    return iter;
+}
+
+const unsigned char *
+rt_iter_key(const rt_iter *iter)
+{
+    if(!iter || !iter->curr || !iter->value) return NULL;
+    return iter->key;
+}
+
+size_t
+rt_iter_keylen(const rt_iter *iter)
+{
+    if(!iter || !iter->curr || !iter->value) return 0;
+    return iter->klen;
+}
+
+const void *
+rt_iter_value(const rt_iter *iter)
+{
+    /* not reloaded: a concurrent writer may have removed it since */
+    if(!iter || !iter->curr) return NULL;
+    return iter->value;
+}
+
+typedef struct {
+    const rt_tree *t;
+    void *usr_ctxt;
+    void (*mapfunc)(void *, unsigned char *, size_t, void *);
+    unsigned char *key;         /* ikey, or on the heap for long keys */
+    size_t kcap;
+    unsigned char ikey[MAX_KEY_LENGTH+1];
+} rt_dfs_state;
+
+/* Run a depth-first search (DFS) starting at node */
+static void
+rt_node_dfs(rt_dfs_state *d, const rt_node *node, size_t klen)
+{
+    unsigned char *key;
+    size_t len;
+    int child;
+    rt_node *next;
+    void *value;
+    if(!node) return;
+
+    len = klen+node->klen;
+    if(len >= d->kcap) {
+        if(!(key = rt_grow(d->key,&d->kcap,len+1,1,d->ikey,
+                        d->t->malloc,d->t->free)))
+            return;
+        d->key = key;
+    }
+    memcpy(d->key+klen,NODE_KEY(node),node->klen);
+    d->key[len] = 0;
+    if((value = RT_LOAD(&node->value)))
+        d->mapfunc(d->usr_ctxt, d->key, len, value);
+
+    NODE_FOREACH(node,child,next)
+        rt_node_dfs(d, next, len);
+}
+
+void rt_tree_map(rt_tree *tree, void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt, unsigned char *key,
+            size_t klen, void *value))
+{
+    rt_dfs_state d;
+    int slot;
+    if(!mapfunc || !tree) return;
+
+    d.t = tree;
+    d.usr_ctxt = usr_ctxt;
+    d.mapfunc = mapfunc;
+    d.key = d.ikey;
+    d.kcap = sizeof(d.ikey);
+    slot = rt_epoch_enter(tree);
+    rt_node_dfs(&d, RT_LOAD(&tree->root), 0);
+    rt_epoch_exit(tree,slot);
+    if(d.key != d.ikey) tree->free(d.key);
+}
+
+/*
+ * Pattern search
+ *
+ * rt_walk_node runs an automaton over the keys while it descends the
+ * tree, one key byte at a time, so the bytes of the compressed node
+ * keys are checked without building the keys first. The automaton
+ * state after each key byte is kept on a stack indexed by key length,
+ * where siblings find the state to start from. A subtree is left as
+ * soon as the automaton dies, and is mapped without further checks
+ * once it accepts every continuation.
+ */
+
+enum {
+    RT_WALK_DEAD,       /* no continuation can match */
+    RT_WALK_LIVE,       /* some may */
+    RT_WALK_ALL         /* all of them do */
+};
+
+#define RT_WALK_ANY  (-1)       /* next: any byte may follow */
+#define RT_WALK_NONE 256        /* next: none may */
+
+typedef struct _rt_walk rt_walk;
+
+struct _rt_walk {
+    const rt_tree *t;
+    void *usr_ctxt;
+    void (*mapfunc)(void *, unsigned char *, size_t, void *);
+    const void *aut;            /* the automaton */
+    size_t ssize;               /* automaton state size, in bytes */
+    /* step from state @a s over byte @a c into @a to; returns RT_WALK_* */
+    int (*step)(const void *aut, const void *s, unsigned char c, void *to);
+    int (*accept)(const void *aut, const void *s);
+    /* the only byte that can follow state @a s; optional */
+    int (*next)(const void *aut, const void *s);
+    unsigned char *states;      /* state after each key byte */
+    size_t scap;
+    unsigned char *key;         /* ikey, or on the heap for long keys */
+    size_t kcap;
+    unsigned char ikey[MAX_KEY_LENGTH+1];
+};
+
+static void
+rt_walk_node(rt_walk *w, const rt_node *node, size_t klen, int all)
+{
+    const unsigned char *k = NODE_KEY(node);
+    unsigned char *p;
+    size_t len = klen+node->klen, i;
+    rt_node *next;
+    void *value;
+    int c, r;
+
+    if(len >= w->kcap) {
+        if(!(p = rt_grow(w->key,&w->kcap,len+1,1,w->ikey,
+                        w->t->malloc,w->t->free)))
+            return;
+        w->key = p;
+    }
+    if(!all && len >= w->scap) {
+        if(!(p = rt_grow(w->states,&w->scap,len+1,w->ssize,NULL,
+                        w->t->malloc,w->t->free)))
+            return;
+        w->states = p;
+    }
+    memcpy(w->key+klen,k,node->klen);
+    w->key[len] = 0;
+    for(i=klen;!all && i<len;i++) {
+        r = w->step(w->aut,w->states+i*w->ssize,k[i-klen],
+                w->states+(i+1)*w->ssize);
+        if(r == RT_WALK_DEAD) return;
+        all = r == RT_WALK_ALL;
+    }
+    if((value = RT_LOAD(&node->value))
+            && (all || w->accept(w->aut,w->states+len*w->ssize)))
+        w->mapfunc(w->usr_ctxt,w->key,len,value);
+
+    c = all || !w->next ? RT_WALK_ANY : w->next(w->aut,w->states+len*w->ssize);
+    if(c == RT_WALK_ANY) {
+        NODE_FOREACH(node,c,next)
+            rt_walk_node(w,next,len,all);
+    } else if(c != RT_WALK_NONE && (next = rt_node_child(node,c))) {
+        rt_walk_node(w,next,len,0);
+    }
+}
+
+/*
+ * Walk @a w over the tree; the automaton start state must be in the
+ * first slot of the states buffer, which rt_walk_init allocates.
+ */
+static int
+rt_walk_init(rt_walk *w, const rt_tree *t, void *usr_ctxt,
+        void (*mapfunc)(void *, unsigned char *, size_t, void *),
+        const void *aut, size_t ssize)
+{
+    w->t = t;
+    w->usr_ctxt = usr_ctxt;
+    w->mapfunc = mapfunc;
+    w->aut = aut;
+    w->ssize = ssize;
+    w->next = NULL;
+    w->key = w->ikey;
+    w->kcap = sizeof(w->ikey);
+    w->scap = MAX_KEY_LENGTH+1;
+    w->states = t->malloc(w->scap*ssize);
+    return w->states != NULL;
+}
+
+static void
+rt_walk_run(rt_walk *w)
+{
+    int slot = rt_epoch_enter(w->t);
+    rt_walk_node(w,RT_LOAD(&w->t->root),0,0);
+    rt_epoch_exit(w->t,slot);
+    w->t->free(w->states);
+    if(w->key != w->ikey) w->t->free(w->key);
+}
+
+/*
+ * Glob patterns
+ *
+ * A pattern compiles to a sequence of tokens, each either a star or a
+ * set of bytes. The automaton state is the set of token positions the
+ * key read so far may have reached, as a bitmap; position ntok means
+ * the whole pattern was matched. Adding a position also adds the one
+ * after a star, since a star may match nothing.
+ */
+
+typedef struct {
+    int16_t lit;                /* the only byte in set, or RT_WALK_ANY */
+    uint8_t star;
+    uint8_t set[32];            /* bitmap of the bytes matched */
+} rt_glob_tok;
+
+typedef struct {
+    rt_glob_tok *tok;
+    size_t ntok;
+    size_t words;               /* uint64_t words per state */
+} rt_glob;
+
+#define GLOB_TEST(set,c) ((set)[(c)>>3] & (1u << ((c)&7)))
+#define GLOB_ADD(set,c)  ((set)[(c)>>3] |= 1u << ((c)&7))
+
+static void
+rt_glob_add(const rt_glob *g, uint64_t *s, size_t i)
+{
+    s[i/64] |= (uint64_t)1 << (i%64);
+    if(i < g->ntok && g->tok[i].star)
+        s[(i+1)/64] |= (uint64_t)1 << ((i+1)%64);
+}
+
+static int
+rt_glob_step(const void *aut, const void *from, unsigned char c, void *to)
+{
+    const rt_glob *g = aut;
+    const uint64_t *f = from;
+    uint64_t *s = to, m, any = 0;
+    size_t i, j;
+    memset(s,0,g->words*sizeof(*s));
+    for(j=0;j<g->words;j++) {
+        for(m=f[j];m;m&=m-1) {
+            i = j*64 + __builtin_ctzll(m);
+            if(i == g->ntok) continue;
+            if(g->tok[i].star) rt_glob_add(g,s,i);
+            else if(GLOB_TEST(g->tok[i].set,c)) rt_glob_add(g,s,i+1);
+        }
+        any |= s[j];
+    }
+    if(!any) return RT_WALK_DEAD;
+    /* a trailing star accepts whatever follows */
+    if(g->ntok && g->tok[g->ntok-1].star
+            && (s[g->ntok/64] & (uint64_t)1 << (g->ntok%64)))
+        return RT_WALK_ALL;
+    return RT_WALK_LIVE;
+}
+
+static int
+rt_glob_accept(const void *aut, const void *s)
+{
+    const rt_glob *g = aut;
+    return (((const uint64_t *)s)[g->ntok/64] >> (g->ntok%64)) & 1;
+}
+
+/* Literal runs of the pattern are looked up instead of scanned */
+static int
+rt_glob_next(const void *aut, const void *from)
+{
+    const rt_glob *g = aut;
+    const uint64_t *f = from;
+    uint64_t m;
+    size_t i, j;
+    int c = RT_WALK_NONE;
+    for(j=0;j<g->words;j++) {
+        for(m=f[j];m;m&=m-1) {
+            i = j*64 + __builtin_ctzll(m);
+            if(i == g->ntok) continue;
+            if(g->tok[i].lit == RT_WALK_ANY
+                    || (c != RT_WALK_NONE && c != g->tok[i].lit))
+                return RT_WALK_ANY;
+            c = g->tok[i].lit;
+        }
+    }
+    return c;
+}
+
+/*
+ * Parse the bracket expression at @a p, up to @a end, into @a set;
+ * returns the end of the expression, or NULL if it is not closed. A
+ * leading '^' negates the set, and so does '!' in a glob.
+ */
+static const unsigned char *
+rt_glob_class(const unsigned char *p, const unsigned char *end,
+        uint8_t *set, int glob)
+{
+    int neg = 0, lo, hi, c;
+    if(p < end && ((glob && *p == '!') || *p == '^')) {
+        neg = 1;
+        p++;
+    }
+    /* a ']' right after the opening bracket is a member */
+    for(c=0;p < end && (*p != ']' || !c);c=1) {
+        if(*p == '\\' && p+1 < end) p++;
+        lo = hi = *p++;
+        if(p+1 < end && *p == '-' && p[1] != ']') {
+            p++;
+            if(*p == '\\' && p+1 < end) p++;
+            hi = *p++;
+        }
+        for(;lo<=hi;lo++) GLOB_ADD(set,lo);
+    }
+    if(p >= end) return NULL;
+    if(neg)
+        for(c=0;c<32;c++) set[c] = ~set[c];
+    return p+1;
+}
+
+static int
+rt_glob_compile(const rt_tree *t, rt_glob *g, const unsigned char *pattern,
+        size_t plen)
+{
+    const unsigned char *p = pattern, *end = pattern+plen;
+    rt_glob_tok *tok;
+    int c, n;
+
+    /* no more tokens than pattern bytes */
+    g->ntok = 0;
+    g->words = plen/64 + 1;
+    g->tok = t->malloc((plen ? plen : 1)*sizeof(*g->tok));
+    if(!g->tok) return 0;
+    while(p < end) {
+        /* runs of stars are one star */
+        if(*p == '*' && g->ntok && g->tok[g->ntok-1].star) {
+            p++;
+            continue;
+        }
+        tok = &g->tok[g->ntok++];
+        memset(tok,0,sizeof(*tok));
+        tok->lit = RT_WALK_ANY;
+        switch(*p) {
+        case '*':
+            tok->star = 1;
+            p++;
+            break;
+        case '?':
+            memset(tok->set,0xff,sizeof(tok->set));
+            p++;
+            break;
+        case '[':
+            if(!(p = rt_glob_class(p+1,end,tok->set,1))) {
+                t->free(g->tok);
+                return 0;
+            }
+            break;
+        default:
+            if(*p == '\\' && p+1 < end) p++;
+            GLOB_ADD(tok->set,*p);
+            p++;
+        }
+        for(c=0,n=0;!tok->star && c<256;c++)
+            if(GLOB_TEST(tok->set,c)) {
+                tok->lit = c;
+                n++;
+            }
+        if(n != 1) tok->lit = RT_WALK_ANY;
+    }
+    return 1;
+}
+
+int
+rt_tree_match(const rt_tree *t, const unsigned char *pattern, size_t plen,
+        void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt, unsigned char *key,
+            size_t klen, void *value))
+{
+    rt_glob g;
+    rt_walk w;
+    if(!t || !pattern || !mapfunc) return 0;
+    if(!rt_glob_compile(t,&g,pattern,plen)) return 0;
+    if(!rt_walk_init(&w,t,usr_ctxt,mapfunc,&g,g.words*sizeof(uint64_t))) {
+        t->free(g.tok);
+        return 0;
+    }
+    w.step = rt_glob_step;
+    w.accept = rt_glob_accept;
+    w.next = rt_glob_next;
+    memset(w.states,0,w.ssize);
+    rt_glob_add(&g,(uint64_t *)w.states,0);
+    rt_walk_run(&w);
+    t->free(g.tok);
+    return 1;
+}
+
+/*
+ * Fuzzy search
+ *
+ * The automaton state is the edit distance DP row of the key read so
+ * far against the query: entry j is the distance to its first j bytes,
+ * capped at max+1. For transpositions the state also carries the row
+ * before it and the last key byte. The state dies once no entry of
+ * the row is within max.
+ */
+
+typedef struct {
+    const unsigned char *key;
+    size_t len;
+    uint32_t max;
+    int damerau;
+} rt_fuzzy;
+
+#define FUZZY_PREV(f,s) ((s)+(f)->len+1)
+#define FUZZY_LAST(f,s) ((s)[2*(f)->len+2])
+
+static int
+rt_fuzzy_step(const void *aut, const void *from, unsigned char c, void *to)
+{
+    const rt_fuzzy *f = aut;
+    const uint32_t *r = from, *p = FUZZY_PREV(f,r);
+    uint32_t *s = to, d, min;
+    size_t j;
+    min = s[0] = r[0] < f->max ? r[0]+1 : f->max+1;
+    for(j=1;j<=f->len;j++) {
+        d = r[j-1] + (f->key[j-1] != c);
+        if(r[j]+1 < d) d = r[j]+1;
+        if(s[j-1]+1 < d) d = s[j-1]+1;
+        if(f->damerau && j > 1 && c == f->key[j-2]
+                && FUZZY_LAST(f,r) == f->key[j-1] && p[j-2]+1 < d)
+            d = p[j-2]+1;
+        s[j] = d > f->max ? f->max+1 : d;
+        if(s[j] < min) min = s[j];
+    }
+    if(f->damerau) {
+        memcpy(FUZZY_PREV(f,s),r,(f->len+1)*sizeof(*r));
+        FUZZY_LAST(f,s) = c;
+    }
+    return min > f->max ? RT_WALK_DEAD : RT_WALK_LIVE;
+}
+
+static int
+rt_fuzzy_accept(const void *aut, const void *s)
+{
+    const rt_fuzzy *f = aut;
+    return ((const uint32_t *)s)[f->len] <= f->max;
+}
+
+/*
+ * With no edits left, the key can only go on along the query: if all
+ * entries at the limit agree on the next query byte, that child is the
+ * only one worth visiting.
+ */
+static int
+rt_fuzzy_next(const void *aut, const void *from)
+{
+    const rt_fuzzy *f = aut;
+    const uint32_t *r = from;
+    size_t j;
+    int c = RT_WALK_NONE;
+    for(j=0;j<=f->len;j++) {
+        if(r[j] < f->max) return RT_WALK_ANY;
+        if(r[j] > f->max || j == f->len) continue;
+        if(c != RT_WALK_NONE && c != f->key[j]) return RT_WALK_ANY;
+        c = f->key[j];
+    }
+    return c;
+}
+
+int
+rt_tree_fuzzy(const rt_tree *t, const unsigned char *key, size_t lkey,
+        unsigned int max_dist, unsigned int flags, void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt, unsigned char *key,
+            size_t klen, void *value))
+{
+    rt_fuzzy f;
+    rt_walk w;
+    uint32_t *s;
+    size_t j;
+    if(!t || (!key && lkey) || !mapfunc || max_dist >= UINT32_MAX/2)
+        return 0;
+    f.key = key;
+    f.len = lkey;
+    f.max = max_dist;
+    f.damerau = !!(flags & RT_FUZZY_DAMERAU);
+    if(!rt_walk_init(&w,t,usr_ctxt,mapfunc,&f,
+                (f.damerau ? 2*lkey+3 : lkey+1)*sizeof(*s)))
+        return 0;
+    w.step = rt_fuzzy_step;
+    w.accept = rt_fuzzy_accept;
+    w.next = rt_fuzzy_next;
+    s = (uint32_t *)w.states;
+    for(j=0;j<=lkey;j++) {
+        s[j] = j > max_dist ? max_dist+1 : j;
+        if(f.damerau) FUZZY_PREV(&f,s)[j] = max_dist+1;
+    }
+    if(f.damerau) FUZZY_LAST(&f,s) = 0;
+    rt_walk_run(&w);
+    return 1;
+}
+
+/*
+ * Regular expressions
+ *
+ * rt_dfa_new parses a regular expression into a Thompson NFA and turns
+ * that into a DFA by subset construction, up to DFA_MAX_STATES states.
+ * Bytes that no bracket expression or literal of the expression tells
+ * apart form one byte class, and the transition table has a column per
+ * class rather than per byte. The dead state, from which nothing can
+ * match any more, is not stored: transitions to it are -1.
+ *
+ * rt_tree_intersect walks the tree with a DFA state as the automaton
+ * state. Every node is reached by exactly one key, so each subtree is
+ * visited at most once, in the one DFA state that key leads to.
+ */
+
+#define DFA_MAX_STATES 16384
+
+enum {
+    NFA_SET,                    /* one byte of set, then out */
+    NFA_SPLIT,                  /* both out and out1 */
+    NFA_EPS,                    /* nothing, then out */
+    NFA_MATCH
+};
+
+typedef struct {
+    uint8_t type;
+    int out, out1;
+    uint8_t set[32];
+} rt_nfa_state;
+
+/*
+ * A partly built NFA: the start state, and the list of its arrows that
+ * still point nowhere. Arrow 2*i is the out of state i, 2*i+1 its out1;
+ * until patched, an arrow holds the next one in the list, or -1.
+ */
+typedef struct {
+    int start;
+    int out;
+} rt_frag;
+
+typedef struct {
+    rt_nfa_state *s;
+    size_t n, cap;
+    const unsigned char *p, *end;
+    int err;
+} rt_nfa;
+
+#define NFA_ARROW(a,i) ((i)&1 ? &(a)->s[(i)>>1].out1 : &(a)->s[(i)>>1].out)
+
+struct _rt_dfa {
+    uint8_t cls[256];           /* byte class of each byte */
+    size_t ncls;
+    size_t nstates;
+    int32_t *trans;             /* nstates x ncls; -1 is the dead state */
+    uint8_t *flags;             /* DFA_ACCEPT, DFA_ALL */
+    int16_t *next;              /* see rt_walk next */
+};
+
+#define DFA_ACCEPT 0x01
+#define DFA_ALL    0x02         /* accepts, and so does every successor */
+
+static void
+rt_nfa_patch(rt_nfa *a, int l, int target)
+{
+    int *f;
+    while(l >= 0) {
+        f = NFA_ARROW(a,l);
+        l = *f;
+        *f = target;
+    }
+}
+
+static int
+rt_nfa_append(rt_nfa *a, int l1, int l2)
+{
+    int *f, l = l1;
+    if(l1 < 0) return l2;
+    while(*(f = NFA_ARROW(a,l)) >= 0) l = *f;
+    *f = l2;
+    return l1;
+}
+
+static int
+rt_nfa_new(rt_nfa *a, uint8_t type, int out, int out1)
+{
+    rt_nfa_state *s;
+    if(a->n >= a->cap) {
+        a->err = 1;
+        return 0;
+    }
+    s = &a->s[a->n];
+    memset(s,0,sizeof(*s));
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return a->n++;
+}
+
+static rt_frag rt_nfa_alt(rt_nfa *a);
+
+static rt_frag
+rt_nfa_atom(rt_nfa *a)
+{
+    rt_frag f = { 0, -1 };
+    const unsigned char *p;
+    int i;
+    switch(*a->p) {
+    case '(':
+        a->p++;
+        f = rt_nfa_alt(a);
+        if(a->p >= a->end || *a->p != ')') a->err = 1;
+        else a->p++;
+        return f;
+    case '*':
+    case '+':
+    case '?':
+        /* nothing to repeat */
+        a->err = 1;
+        return f;
+    }
+    i = rt_nfa_new(a,NFA_SET,-1,-1);
+    if(a->err) return f;
+    switch(*a->p) {
+    case '.':
+        memset(a->s[i].set,0xff,sizeof(a->s[i].set));
+        a->p++;
+        break;
+    case '[':
+        if(!(p = rt_glob_class(a->p+1,a->end,a->s[i].set,0))) {
+            a->err = 1;
+            return f;
+        }
+        a->p = p;
+        break;
+    default:
+        if(*a->p == '\\' && a->p+1 < a->end) a->p++;
+        GLOB_ADD(a->s[i].set,*a->p);
+        a->p++;
+    }
+    f.start = i;
+    f.out = 2*i;
+    return f;
+}
+
+static rt_frag
+rt_nfa_rep(rt_nfa *a)
+{
+    rt_frag f = rt_nfa_atom(a);
+    int s;
+    while(!a->err && a->p < a->end
+            && (*a->p == '*' || *a->p == '+' || *a->p == '?')) {
+        s = rt_nfa_new(a,NFA_SPLIT,f.start,-1);
+        if(a->err) break;
+        switch(*a->p++) {
+        case '*':
+            rt_nfa_patch(a,f.out,s);
+            f.start = s;
+            f.out = 2*s+1;
+            break;
+        case '+':
+            rt_nfa_patch(a,f.out,s);
+            f.out = 2*s+1;
+            break;
+        default:
+            f.start = s;
+            f.out = rt_nfa_append(a,f.out,2*s+1);
+        }
+    }
+    return f;
+}
+
+static rt_frag
+rt_nfa_cat(rt_nfa *a)
+{
+    rt_frag f = { -1, -1 }, g;
+    int e;
+    while(!a->err && a->p < a->end && *a->p != '|' && *a->p != ')') {
+        g = rt_nfa_rep(a);
+        if(f.start < 0) {
+            f = g;
+        } else {
+            rt_nfa_patch(a,f.out,g.start);
+            f.out = g.out;
+        }
+    }
+    if(f.start < 0) {
+        e = rt_nfa_new(a,NFA_EPS,-1,-1);
+        f.start = e;
+        f.out = 2*e;
+    }
+    return f;
+}
+
+static rt_frag
+rt_nfa_alt(rt_nfa *a)
+{
+    rt_frag f = rt_nfa_cat(a), g;
+    int s;
+    while(!a->err && a->p < a->end && *a->p == '|') {
+        a->p++;
+        g = rt_nfa_cat(a);
+        s = rt_nfa_new(a,NFA_SPLIT,f.start,g.start);
+        f.start = s;
+        f.out = rt_nfa_append(a,f.out,g.out);
+    }
+    return f;
+}
+
+/* Add NFA state @a i and the states it reaches without a byte to @a set */
+static void
+rt_nfa_close(const rt_nfa *a, uint64_t *set, int i)
+{
+    while(!(set[i/64] & (uint64_t)1 << (i%64))) {
+        set[i/64] |= (uint64_t)1 << (i%64);
+        if(a->s[i].type == NFA_SPLIT) {
+            rt_nfa_close(a,set,a->s[i].out1);
+        } else if(a->s[i].type != NFA_EPS) {
+            break;
+        }
+        i = a->s[i].out;
+    }
+}
+
+/* Group the bytes that every NFA_SET state treats alike */
+static void
+rt_dfa_classes(rt_dfa *d, const rt_nfa *a)
+{
+    unsigned char rep[256];
+    size_t i, k;
+    int c;
+    d->ncls = 0;
+    for(c=0;c<256;c++) {
+        for(k=0;k<d->ncls;k++) {
+            for(i=0;i<a->n;i++)
+                if(a->s[i].type == NFA_SET
+                        && !GLOB_TEST(a->s[i].set,c)
+                            != !GLOB_TEST(a->s[i].set,rep[k]))
+                    break;
+            if(i == a->n) break;
+        }
+        if(k == d->ncls) rep[d->ncls++] = c;
+        d->cls[c] = k;
+    }
+}
+
+/*
+ * Find the DFA state for the NFA state set @a set in the hash table
+ * @a h of @a hcap slots, adding it if it is new; returns its index, or
+ * -1 if there are too many states or no memory
+ */
+static int32_t
+rt_dfa_state(rt_dfa *d, uint64_t **sets, size_t *scap, size_t words,
+        int32_t *h, size_t hcap, const uint64_t *set)
+{
+    uint64_t hash = 14695981039346656037ULL, *r;
+    size_t i, sz = words*sizeof(*set);
+    for(i=0;i<words;i++) hash = (hash ^ set[i]) * 1099511628211ULL;
+    for(i=hash&(hcap-1);h[i]>=0;i=(i+1)&(hcap-1))
+        if(!memcmp(*sets+h[i]*words,set,sz)) return h[i];
+    if(d->nstates >= DFA_MAX_STATES) return -1;
+    if(d->nstates >= *scap) {
+        r = rt_grow(*sets,scap,d->nstates+1,sz,NULL,malloc,free);
+        if(!r) return -1;
+        *sets = r;
+    }
+    memcpy(*sets+d->nstates*words,set,sz);
+    h[i] = d->nstates;
+    return d->nstates++;
+}
+
+/* Subset construction; the DFA states are numbered in discovery order */
+static int
+rt_dfa_build(rt_dfa *d, const rt_nfa *a, int start)
+{
+    size_t words = a->n/64 + 1, scap = 64, tcap = 64, hcap, i, j, k;
+    uint64_t *sets, *set, m;
+    int32_t *h, *r, n;
+    unsigned char rep[256];     /* a byte of each class */
+    uint16_t size[256];         /* bytes in each class */
+    int c, ret = 0;
+
+    hcap = 2;
+    while(hcap < 2*DFA_MAX_STATES) hcap *= 2;
+    sets = malloc(scap*words*sizeof(*sets));
+    set = malloc(words*sizeof(*set));
+    h = malloc(hcap*sizeof(*h));
+    d->trans = malloc(tcap*d->ncls*sizeof(*d->trans));
+    if(!sets || !set || !h || !d->trans) goto done;
+    memset(h,0xff,hcap*sizeof(*h));
+    memset(size,0,sizeof(size));
+    for(c=0;c<256;c++) {
+        rep[d->cls[c]] = c;
+        size[d->cls[c]]++;
+    }
+
+    memset(set,0,words*sizeof(*set));
+    rt_nfa_close(a,set,start);
+    if(rt_dfa_state(d,&sets,&scap,words,h,hcap,set) < 0) goto done;
+    for(i=0;i<d->nstates;i++) {
+        if(d->nstates > tcap) {
+            r = rt_grow(d->trans,&tcap,d->nstates,
+                    d->ncls*sizeof(*d->trans),NULL,malloc,free);
+            if(!r) goto done;
+            d->trans = r;
+        }
+        for(k=0;k<d->ncls;k++) {
+            memset(set,0,words*sizeof(*set));
+            for(j=0;j<words;j++) {
+                for(m=sets[i*words+j];m;m&=m-1) {
+                    n = j*64 + __builtin_ctzll(m);
+                    if(a->s[n].type == NFA_SET
+                            && GLOB_TEST(a->s[n].set,rep[k]))
+                        rt_nfa_close(a,set,a->s[n].out);
+                }
+            }
+            for(j=0;j<words && !set[j];j++);
+            n = -1;
+            if(j < words && (n = rt_dfa_state(d,&sets,&scap,words,h,hcap,
+                            set)) < 0)
+                goto done;
+            d->trans[i*d->ncls+k] = n;
+        }
+    }
+
+    d->flags = calloc(d->nstates,sizeof(*d->flags));
+    d->next = malloc(d->nstates*sizeof(*d->next));
+    if(!d->flags || !d->next) goto done;
+    for(i=0;i<d->nstates;i++) {
+        for(j=0;j<a->n;j++)
+            if(a->s[j].type == NFA_MATCH
+                    && (sets[i*words+j/64] >> (j%64)) & 1)
+                d->flags[i] = DFA_ACCEPT | DFA_ALL;
+        d->next[i] = RT_WALK_NONE;
+        for(k=0;k<d->ncls;k++) {
+            n = d->trans[i*d->ncls+k];
+            if(n != (int32_t)i) d->flags[i] &= ~DFA_ALL;
+            if(n < 0) continue;
+            /* a single live byte can be looked up */
+            if(d->next[i] != RT_WALK_NONE || size[k] > 1)
+                d->next[i] = RT_WALK_ANY;
+            else
+                d->next[i] = rep[k];
+        }
+    }
+    ret = 1;
+done:
+    free(sets);
+    free(set);
+    free(h);
+    return ret;
+}
+
+void
+rt_dfa_free(rt_dfa *d)
+{
+    if(!d) return;
+    free(d->trans);
+    free(d->flags);
+    free(d->next);
+    free(d);
+}
+
+rt_dfa *
+rt_dfa_new(const unsigned char *regex, size_t len)
+{
+    rt_nfa a;
+    rt_frag f;
+    rt_dfa *d;
+    int m;
+    if(!regex && len) return NULL;
+    a.p = regex;
+    a.end = regex+len;
+    a.err = 0;
+    a.n = 0;
+    /* at most one state per regex byte and '|', plus the match state */
+    a.cap = 2*len+2;
+    a.s = malloc(a.cap*sizeof(*a.s));
+    d = calloc(1,sizeof(*d));
+    if(!a.s || !d) goto fail;
+
+    f = rt_nfa_alt(&a);
+    /* an unmatched ')' stops the parse early */
+    if(a.p < a.end) a.err = 1;
+    m = rt_nfa_new(&a,NFA_MATCH,-1,-1);
+    if(a.err) goto fail;
+    rt_nfa_patch(&a,f.out,m);
+    rt_dfa_classes(d,&a);
+    if(!rt_dfa_build(d,&a,f.start)) goto fail;
+    free(a.s);
+    return d;
+fail:
+    free(a.s);
+    rt_dfa_free(d);
+    return NULL;
+}
+
+static int
+rt_dfa_step(const void *aut, const void *from, unsigned char c, void *to)
+{
+    const rt_dfa *d = aut;
+    int32_t n = d->trans[*(const int32_t *)from*d->ncls+d->cls[c]];
+    if(n < 0) return RT_WALK_DEAD;
+    *(int32_t *)to = n;
+    return d->flags[n] & DFA_ALL ? RT_WALK_ALL : RT_WALK_LIVE;
+}
+
+static int
+rt_dfa_accept(const void *aut, const void *s)
+{
+    return ((const rt_dfa *)aut)->flags[*(const int32_t *)s] & DFA_ACCEPT;
+}
+
+static int
+rt_dfa_next(const void *aut, const void *s)
+{
+    return ((const rt_dfa *)aut)->next[*(const int32_t *)s];
+}
+
+int
+rt_tree_intersect(const rt_tree *t, const rt_dfa *dfa, void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt, unsigned char *key,
+            size_t klen, void *value))
+{
+    rt_walk w;
+    if(!t || !dfa || !mapfunc) return 0;
+    if(!rt_walk_init(&w,t,usr_ctxt,mapfunc,dfa,sizeof(int32_t)))
+        return 0;
+    w.step = rt_dfa_step;
+    w.accept = rt_dfa_accept;
+    w.next = rt_dfa_next;
+    *(int32_t *)w.states = 0;
+    rt_walk_run(&w);
+    return 1;
+}
+
+/*
+ * Parallel map
+ *
+ * The tree is cut into subtree tasks. By default every worker has a
+ * deque of tasks: it takes its own newest task and, once it runs dry,
+ * steals the oldest (and so largest) task of another worker. While
+ * some workers are idle, the busy ones split nodes with a high fanout
+ * into new tasks instead of descending. With RT_MAP_ORDERED each worker
+ * gets one contiguous run of the tasks and walks it in key order,
+ * without splitting or stealing.
+ */
+
+#define MAP_SPLIT_FANOUT     16 /* split nodes with this many children */
+#define MAP_TASKS_PER_THREAD 8  /* initial tasks per worker */
+
+typedef struct {
+    const rt_node *node;
+    int self;                   /* only the node value, not the subtree */
+} rt_map_task;
+
+typedef struct _rt_map_pool rt_map_pool;
+
+typedef struct {
+    rt_map_pool *pool;
+    pthread_mutex_t lock;       /* guards the deque */
+    rt_map_task *tasks;         /* deque, oldest task at head */
+    size_t head, tail, cap;
+    size_t first, last;         /* ordered mode: run of initial tasks */
+    unsigned char *key;         /* ikey, or on the heap for long keys */
+    size_t kcap;
+    unsigned char ikey[MAX_KEY_LENGTH+1];
+} rt_map_worker;
+
+struct _rt_map_pool {
+    const rt_tree *t;
+    void *usr_ctxt;
+    void (*mapfunc)(void *, unsigned char *, size_t, void *);
+    rt_map_worker *workers;
+    unsigned int nworkers;
+    int ordered;
+    size_t pending;             /* tasks queued or running */
+    unsigned int idle;          /* workers looking for a task */
+    rt_map_task *initial;       /* ordered mode: tasks in key order */
+};
+
+/* Queue a task in @a w; returns 0 if there is no memory for it */
+static int
+rt_map_push(rt_map_worker *w, const rt_node *node, int self)
+{
+    const rt_tree *t = w->pool->t;
+    rt_map_task *tasks, *task;
+    size_t cap;
+
+    pthread_mutex_lock(&w->lock);
+    if(w->tail == w->cap) {
+        cap = w->cap ? w->cap*2 : 64;
+        if(w->head > 0) {
+            /* compact before growing */
+            memmove(w->tasks,w->tasks+w->head,
+                    (w->tail-w->head)*sizeof(*tasks));
+            w->tail -= w->head;
+            w->head = 0;
+        } else if((tasks = t->malloc(cap*sizeof(*tasks)))) {
+            if(w->tasks) {
+                memcpy(tasks,w->tasks,w->tail*sizeof(*tasks));
+                t->free(w->tasks);
+            }
+            w->tasks = tasks;
+            w->cap = cap;
+        } else {
+            pthread_mutex_unlock(&w->lock);
+            return 0;
+        }
+    }
+    task = &w->tasks[w->tail++];
+    task->node = node;
+    task->self = self;
+    __atomic_add_fetch(&w->pool->pending,1,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+}
+
+/* Take the newest task of @a w, or with @a steal the oldest one */
+static int
+rt_map_pop(rt_map_worker *w, rt_map_task *task, int steal)
+{
+    int ret = 0;
+    pthread_mutex_lock(&w->lock);
+    if(w->head < w->tail) {
+        *task = w->tasks[steal ? w->head++ : --w->tail];
+        ret = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+/* Map the subtree of @a node, whose key starts at w->key[klen] */
+static void
+rt_map_dfs(rt_map_worker *w, const rt_node *node, size_t klen, int self)
+{
+    rt_map_pool *pool = w->pool;
+    unsigned char *key;
+    size_t len;
+    int child, split;
+    rt_node *next;
+    void *value;
+
+    len = klen+node->klen;
+    if(len >= w->kcap) {
+        if(!(key = rt_grow(w->key,&w->kcap,len+1,1,w->ikey,
+                        pool->t->malloc,pool->t->free)))
+            return;
+        w->key = key;
+    }
+    memcpy(w->key+klen,NODE_KEY(node),node->klen);
+    w->key[len] = 0;
+    if((value = RT_LOAD(&node->value)))
+        pool->mapfunc(pool->usr_ctxt, w->key, len, value);
+    if(self) return;
+
+    split = !pool->ordered && node->lcnt >= MAP_SPLIT_FANOUT
+        && __atomic_load_n(&pool->idle,__ATOMIC_RELAXED) > 0;
+    NODE_FOREACH(node,child,next)
+        if(!split || !rt_map_push(w,next,0))
+            rt_map_dfs(w,next,len,0);
+}
+
+/*
+ * Run a task. Its key up to the node is rebuilt from the parent chain:
+ * a concurrent writer may replace those nodes meanwhile, but the keys
+ * along either chain are the same, and nothing seen inside the epoch
+ * of the caller is freed.
+ */
+static void
+rt_map_run(rt_map_worker *w, const rt_node *node, int self)
+{
+    const rt_tree *t = w->pool->t;
+    const rt_node *p;
+    unsigned char *key;
+    size_t klen = 0, len;
+
+    for(p=RT_LOAD(&node->parent);p;p=RT_LOAD(&p->parent))
+        klen += p->klen;
+    if(klen >= w->kcap) {
+        if(!(key = rt_grow(w->key,&w->kcap,klen+1,1,w->ikey,
+                        t->malloc,t->free)))
+            return;
+        w->key = key;
+    }
+    len = klen;
+    for(p=RT_LOAD(&node->parent);p;p=RT_LOAD(&p->parent)) {
+        len -= p->klen;
+        memcpy(w->key+len,NODE_KEY(p),p->klen);
+    }
+    rt_map_dfs(w,node,klen,self);
+}
+
+static void *
+rt_map_worker_run(void *arg)
+{
+    rt_map_worker *w = arg, *v;
+    rt_map_pool *pool = w->pool;
+    rt_map_task task;
+    unsigned int i, idle = 0;
+    size_t j;
+
+    if(pool->ordered) {
+        for(j=w->first;j<w->last;j++)
+            rt_map_run(w,pool->initial[j].node,pool->initial[j].self);
+        return NULL;
+    }
+
+    while(1) {
+        /* own tasks first, newest first, then steal the oldest */
+        i = 0;
+        v = w;
+        while(!rt_map_pop(v,&task,v!=w) && ++i < pool->nworkers)
+            v = &pool->workers[(w-pool->workers+i) % pool->nworkers];
+        if(i < pool->nworkers) {
+            if(idle) __atomic_sub_fetch(&pool->idle,1,__ATOMIC_RELAXED);
+            idle = 0;
+            rt_map_run(w,task.node,task.self);
+            __atomic_sub_fetch(&pool->pending,1,__ATOMIC_ACQ_REL);
+            continue;
+        }
+        if(!__atomic_load_n(&pool->pending,__ATOMIC_ACQUIRE)) break;
+        if(!idle) __atomic_add_fetch(&pool->idle,1,__ATOMIC_RELAXED);
+        idle = 1;
+        sched_yield();
+    }
+    if(idle) __atomic_sub_fetch(&pool->idle,1,__ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* Append a task to *tasks, which has room for *cap; NULL if no memory */
+static rt_map_task *
+rt_map_add(const rt_tree *t, rt_map_task **tasks, size_t *n, size_t *cap)
+{
+    rt_map_task *r;
+    if(*n == *cap) {
+        r = t->malloc(*cap*2*sizeof(*r));
+        if(!r) return NULL;
+        memcpy(r,*tasks,*n*sizeof(*r));
+        t->free(*tasks);
+        *tasks = r;
+        *cap *= 2;
+    }
+    return &(*tasks)[(*n)++];
+}
+
+/*
+ * Cut the tree into about @a want tasks, in key order, by expanding
+ * nodes into their own value and their children level by level.
+ * Returns the number of tasks in *tasks, or 0 if out of memory.
+ */
+static size_t
+rt_map_split(const rt_tree *t, rt_map_task **tasks, size_t want)
+{
+    rt_map_task *cur, *nxt, *task;
+    size_t n = 1, m, cap, i;
+    int child, grew = 1;
+    rt_node *next;
+
+    if(!(cur = t->malloc(sizeof(*cur)))) return 0;
+    cur->node = RT_LOAD(&t->root);
+    cur->self = 0;
+    while(grew && n < want) {
+        cap = 2*n;
+        if(!(nxt = t->malloc(cap*sizeof(*nxt)))) break;
+        grew = 0;
+        for(i=0, m=0;i<n;i++) {
+            if(cur[i].self || cur[i].node->lcnt == 0) {
+                if(!(task = rt_map_add(t,&nxt,&m,&cap))) goto fail;
+                *task = cur[i];
+                continue;
+            }
+            if(RT_LOAD(&cur[i].node->value)) {
+                if(!(task = rt_map_add(t,&nxt,&m,&cap))) goto fail;
+                *task = cur[i];
+                task->self = 1;
+            }
+            NODE_FOREACH(cur[i].node,child,next) {
+                if(!(task = rt_map_add(t,&nxt,&m,&cap))) goto fail;
+                task->node = next;
+                task->self = 0;
+            }
+            grew = 1;
+        }
+        t->free(cur);
+        cur = nxt;
+        n = m;
+    }
+    *tasks = cur;
+    return n;
+fail:
+    t->free(nxt);
+    t->free(cur);
+    return 0;
+}
+
+void rt_tree_map_parallel(rt_tree *tree, unsigned int nthreads,
+        unsigned int flags, void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt, unsigned char *key,
+            size_t klen, void *value))
+{
+    rt_map_pool pool;
+    rt_map_task *tasks;
+    pthread_t *threads;
+    int *started;
+    size_t ntasks, i;
+    int slot;
     if(!mapfunc || !tree) return;
-    n = tree->root;
-    if(!n || n->lcnt < 1) return;
+    if(nthreads <= 1) {
+        rt_tree_map(tree,usr_ctxt,mapfunc);
+        return;
+    }
+
+    /* the workers run inside the epoch of the caller */
+    slot = rt_epoch_enter(tree);
+    ntasks = rt_map_split(tree,&tasks,(size_t)nthreads*MAP_TASKS_PER_THREAD);
+    pool.workers = tree->malloc(nthreads*sizeof(rt_map_worker));
+    threads = tree->malloc(nthreads*sizeof(pthread_t));
+    started = tree->malloc(nthreads*sizeof(int));
+    if(!ntasks || !pool.workers || !threads || !started) {
+        if(ntasks) tree->free(tasks);
+        if(pool.workers) tree->free(pool.workers);
+        if(threads) tree->free(threads);
+        if(started) tree->free(started);
+        rt_epoch_exit(tree,slot);
+        rt_tree_map(tree,usr_ctxt,mapfunc);
+        return;
+    }
+
+    pool.t = tree;
+    pool.usr_ctxt = usr_ctxt;
+    pool.mapfunc = mapfunc;
+    pool.nworkers = nthreads;
+    pool.ordered = (flags & RT_MAP_ORDERED) != 0;
+    pool.pending = 0;
+    pool.idle = 0;
+    pool.initial = tasks;
+    for(i=0;i<nthreads;i++) {
+        pool.workers[i].pool = &pool;
+        pthread_mutex_init(&pool.workers[i].lock,NULL);
+        pool.workers[i].tasks = NULL;
+        pool.workers[i].head = pool.workers[i].tail = pool.workers[i].cap = 0;
+        pool.workers[i].first = ntasks*i/nthreads;
+        pool.workers[i].last = ntasks*(i+1)/nthreads;
+        pool.workers[i].key = pool.workers[i].ikey;
+        pool.workers[i].kcap = MAX_KEY_LENGTH+1;
+    }
+    for(i=0;i<ntasks && !pool.ordered;i++) {
+        /* deal the tasks out round robin; keep any that do not fit */
+        if(!rt_map_push(&pool.workers[i%nthreads],tasks[i].node,
+                    tasks[i].self))
+            rt_map_run(&pool.workers[0],tasks[i].node,tasks[i].self);
+    }
+
+    for(i=1;i<nthreads;i++)
+        started[i] = !pthread_create(&threads[i],NULL,rt_map_worker_run,
+                &pool.workers[i]);
+    rt_map_worker_run(&pool.workers[0]);
+    for(i=1;i<nthreads;i++) {
+        if(started[i])
+            pthread_join(threads[i],NULL);
+        else
+            rt_map_worker_run(&pool.workers[i]);
+    }
+
+    for(i=0;i<nthreads;i++) {
+        pthread_mutex_destroy(&pool.workers[i].lock);
+        if(pool.workers[i].tasks) tree->free(pool.workers[i].tasks);
+        if(pool.workers[i].key != pool.workers[i].ikey)
+            tree->free(pool.workers[i].key);
+    }
+    tree->free(pool.workers);
+    tree->free(threads);
+    tree->free(started);
+    tree->free(tasks);
+    rt_epoch_exit(tree,slot);
+}
+
+
+/*
+ * Frozen trees
+ *
+ * rt_tree_freeze packs a tree into one contiguous, pointer-free buffer.
+ * Nodes are laid out in depth-first order, so the first child of a node
+ * always follows it directly and every subtree is a contiguous range.
+ * Each node record is 4 byte aligned:
+ *
+ *   uint32_t klen      node key length
+ *   uint32_t value     value index + 1; 0 for placeholder nodes
+ *   uint16_t nchild    number of children
+ *   key[klen]          node key
+ *   byte[nchild]       sorted child discriminator bytes
+ *   (padding to 4)
+ *   uint32_t off[nchild-1]  offsets of children 2..n from this node
+ *
+ * Values are kept in a separate table, indexed by the value field.
+ */
+
+typedef struct {
+    uint32_t klen;
+    uint32_t value;
+    uint16_t nchild;
+    unsigned char data[];
+} rt_fnode;
+
+#define FNODE_HDR 10
+#define FNODE_OFFS(klen,nchild) ((FNODE_HDR+(klen)+(nchild)+3) & ~(size_t)3)
+#define FNODE_SIZE(klen,nchild) \
+    (FNODE_OFFS(klen,nchild) + 4*((nchild)>1 ? (nchild)-1 : 0))
+#define FNODE_KEY(f)   ((f)->data)
+#define FNODE_BYTES(f) ((f)->data+(f)->klen)
+
+struct _rt_frozen {
+    const unsigned char *base;  /* node records; the root is at 0 */
+    size_t size;                /* size of the node records */
+    void **values;              /* value table */
+    size_t nvalues;
+    const uint64_t *voffs;      /* mapped value offsets into blob */
+    const unsigned char *blob;  /* mapped value data */
+    void *map;                  /* file mapping, or NULL */
+    size_t maplen;
+    void * (* malloc)(size_t);  /* iterator alloc callback */
+    void (*free)(void *);       /* frozen tree free callback */
+};
+
+typedef struct {
+    const rt_fnode *node;
+    uint16_t next;              /* next child to visit */
+    size_t klen;                /* key length including this node */
+} rt_frozen_frame;
+
+struct _rt_frozen_iter {
+    const rt_frozen *f;
+    void (*free)(void *);       /* iter free callback */
+    const rt_fnode *curr;
+    size_t depth;               /* number of stack frames */
+    size_t klen;                /* length of the current key */
+    size_t scap, kcap;          /* stack and key buffer capacity */
+    rt_frozen_frame *stack;     /* istack, or on the heap for deep paths */
+    unsigned char *key;         /* ikey, or on the heap for long keys */
+    rt_frozen_frame istack[RT_ITER_DEPTH];
+    unsigned char ikey[RT_ITER_KEYLEN];
+};
+
+static inline const rt_fnode *
+rt_fnode_child(const rt_fnode *f, int i)
+{
+    size_t off;
+    if(i == 0) off = FNODE_SIZE(f->klen,f->nchild);
+    else off = ((const uint32_t *)((const unsigned char *)f
+                + FNODE_OFFS(f->klen,f->nchild)))[i-1];
+    return (const rt_fnode *)((const unsigned char *)f + off);
+}
+
+/* Return the child with discriminator byte @a c, or NULL */
+static inline const rt_fnode *
+rt_fnode_find(const rt_fnode *f, unsigned char c)
+{
+    int i;
+    /* a full node holds every byte, in order */
+    if(f->nchild == 256) i = c;
+    else if((i = rt_bytes_find(FNODE_BYTES(f),f->nchild,c)) < 0)
+        return NULL;
+    return rt_fnode_child(f,i);
+}
+
+static inline void *
+rt_frozen_value(const rt_frozen *fz, const rt_fnode *f)
+{
+    if(!f->value) return NULL;
+    if(fz->values) return fz->values[f->value-1];
+    return (void *)(fz->blob + fz->voffs[f->value-1]);
+}
+
+/* Size the frozen subtree of @a n, counting its values in @a nvalues */
+static size_t
+rt_freeze_size(const rt_node *n, size_t *nvalues)
+{
+    size_t sz = FNODE_SIZE(n->klen,n->lcnt);
+    rt_node *l;
+    int c;
+    if(n->value) (*nvalues)++;
+    NODE_FOREACH(n,c,l)
+        sz += rt_freeze_size(l,nvalues);
+    return sz;
+}
+
+/* Write the subtree of @a n at @a out; returns the bytes written */
+static size_t
+rt_freeze_write(const rt_node *n, unsigned char *out, rt_frozen *fz)
+{
+    rt_fnode *f = (rt_fnode *)out;
+    uint32_t *offs = (uint32_t *)(out + FNODE_OFFS(n->klen,n->lcnt));
+    size_t sz = FNODE_SIZE(n->klen,n->lcnt);
+    rt_node *l;
+    int c, i = 0;
+
+    memset(out,0,FNODE_OFFS(n->klen,n->lcnt));
+    f->klen = n->klen;
+    f->nchild = n->lcnt;
+    memcpy(FNODE_KEY(f),NODE_KEY(n),n->klen);
+    if(n->value) {
+        fz->values[fz->nvalues++] = n->value;
+        f->value = fz->nvalues;
+    }
+    NODE_FOREACH(n,c,l) {
+        FNODE_BYTES(f)[i] = c;
+        if(i > 0) offs[i-1] = sz;
+        sz += rt_freeze_write(l,out+sz,fz);
+        i++;
+    }
+    return sz;
+}
+
+rt_frozen *
+rt_tree_freeze(const rt_tree *t)
+{
+    rt_frozen *fz;
+    size_t size, nvalues = 0;
+    if(!t || !t->root) return NULL;
+
+    size = rt_freeze_size(t->root,&nvalues);
+    /* child offsets are 32 bit */
+    if(size > UINT32_MAX) return NULL;
+    fz = t->malloc(sizeof(*fz) + size + nvalues*sizeof(void *));
+    if(!fz) return NULL;
+    fz->values = (void **)(fz+1);
+    fz->base = (unsigned char *)(fz->values+nvalues);
+    fz->size = size;
+    fz->nvalues = 0;
+    fz->voffs = NULL;
+    fz->blob = NULL;
+    fz->map = NULL;
+    fz->maplen = 0;
+    fz->malloc = t->malloc;
+    fz->free = t->free;
+    rt_freeze_write(t->root,(unsigned char *)fz->base,fz);
+    return fz;
+}
+
+void
+rt_frozen_free(rt_frozen *fz)
+{
+    if(!fz) return;
+    if(fz->map) munmap(fz->map,fz->maplen);
+    if(fz->free) fz->free(fz);
+}
+
+size_t
+rt_frozen_size(const rt_frozen *fz)
+{
+    if(!fz) return 0;
+    if(fz->map) return sizeof(*fz) + fz->maplen;
+    return sizeof(*fz) + fz->size + fz->nvalues*sizeof(void *);
+}
+
+/*
+ * Walk down from the root as in rt_node_prefix; with @a exact set the
+ * key must end on a node boundary. The length of the path goes to
+ * @a plen (if not NULL).
+ */
+static const rt_fnode *
+rt_frozen_find(const rt_frozen *fz, const unsigned char *key,
+        size_t lkey, int exact, size_t *plen)
+{
+    const unsigned char *end = key+lkey;
+    const rt_fnode *f = (const rt_fnode *)fz->base;
+    size_t len, done = 0;
+    while(key < end) {
+        if(!(f = rt_fnode_find(f,*key))) return NULL;
+        len = (size_t)(end-key);
+        if(f->klen <= len) len = f->klen;
+        else if(exact) return NULL;
+        if(memcmp(FNODE_KEY(f)+1,key+1,len-1)) return NULL;
+        done += f->klen;
+        key += len;
+    }
+    if(plen) *plen = done;
+    return f;
+}
+
+void *
+rt_frozen_get(const rt_frozen *fz, const unsigned char *key, size_t lkey)
+{
+    const rt_fnode *f;
+    if(!fz || !key || lkey < 1) return NULL;
+    f = rt_frozen_find(fz,key,lkey,1,NULL);
+    return f ? rt_frozen_value(fz,f) : NULL;
+}
+
+void *
+rt_frozen_longest_prefix(const rt_frozen *fz, const unsigned char *key,
+        size_t lkey, size_t *matched)
+{
+    const rt_fnode *f;
+    const unsigned char *k = key, *end = key+lkey;
+    void *best = NULL;
+    size_t blen = 0;
+    if(fz && key) {
+        f = (const rt_fnode *)fz->base;
+        while(k < end && (f = rt_fnode_find(f,*k))) {
+            if(f->klen > (size_t)(end-k)
+                    || memcmp(FNODE_KEY(f)+1,k+1,f->klen-1))
+                break;
+            k += f->klen;
+            if(f->value) {
+                best = rt_frozen_value(fz,f);
+                blen = k-key;
+            }
+        }
+    }
+    if(matched) *matched = blen;
+    return best;
+}
+
+rt_frozen_iter *
+rt_frozen_prefix(const rt_frozen *fz, const unsigned char *prefix,
+        size_t prefixlen)
+{
+    rt_frozen_iter *iter;
+    const rt_fnode *f;
+    size_t klen = 0;
+    if(!fz) return NULL;
+
+    iter = fz->malloc(sizeof(*iter));
+    if(!iter) return NULL;
+    iter->f = fz;
+    iter->free = fz->free;
+    iter->curr = NULL;
+    iter->depth = 0;
+    iter->klen = 0;
+    iter->stack = iter->istack;
+    iter->scap = RT_ITER_DEPTH;
+    iter->key = iter->ikey;
+    iter->kcap = RT_ITER_KEYLEN;
+    if(!prefix || prefixlen < 1)
+        f = (const rt_fnode *)fz->base;
+    else if((f = rt_frozen_find(fz,prefix,prefixlen,0,&klen))) {
+        if(!(iter->key = rt_grow(iter->key,&iter->kcap,klen+1,1,
+                        iter->ikey,fz->malloc,fz->free))) {
+            iter->key = iter->ikey;
+            f = NULL;
+        } else {
+            memcpy(iter->key,prefix,prefixlen);
+            memcpy(iter->key+prefixlen,
+                    FNODE_KEY(f)+f->klen-(klen-prefixlen),klen-prefixlen);
+        }
+    }
+    if(f) {
+        iter->stack[0].node = f;
+        iter->stack[0].next = 0;
+        iter->stack[0].klen = klen;
+        iter->depth = 1;
+    }
+    return iter;
+}
+
+int
+rt_frozen_iter_next(rt_frozen_iter *iter)
+{
+    const rt_frozen *fz;
+    const rt_fnode *f;
+    rt_frozen_frame *stack;
+    unsigned char *key;
+    size_t klen;
+    if(!iter || iter->depth == 0) return 0;
+
+    /* the subtree root itself comes first */
+    if(!iter->curr) {
+        f = iter->stack[0].node;
+        iter->curr = f;
+        iter->klen = iter->stack[0].klen;
+        iter->key[iter->klen] = 0;
+        if(f->value) return 1;
+    }
+    fz = iter->f;
+    while(iter->depth > 0) {
+        f = iter->stack[iter->depth-1].node;
+        if(iter->stack[iter->depth-1].next >= f->nchild) {
+            iter->depth--;
+            continue;
+        }
+        klen = iter->stack[iter->depth-1].klen;
+        f = rt_fnode_child(f,iter->stack[iter->depth-1].next++);
+        if(klen+f->klen >= iter->kcap) {
+            if(!(key = rt_grow(iter->key,&iter->kcap,klen+f->klen+1,1,
+                            iter->ikey,fz->malloc,fz->free)))
+                continue;
+            iter->key = key;
+        }
+        if(iter->depth == iter->scap) {
+            if(!(stack = rt_grow(iter->stack,&iter->scap,iter->depth+1,
+                            sizeof(*stack),iter->istack,fz->malloc,fz->free)))
+                continue;
+            iter->stack = stack;
+        }
+        memcpy(iter->key+klen,FNODE_KEY(f),f->klen);
+        iter->stack[iter->depth].node = f;
+        iter->stack[iter->depth].next = 0;
+        iter->stack[iter->depth].klen = klen+f->klen;
+        iter->depth++;
+        if(f->value) {
+            iter->curr = f;
+            iter->klen = klen+f->klen;
+            iter->key[iter->klen] = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const unsigned char *
+rt_frozen_iter_key(const rt_frozen_iter *iter)
+{
+    if(!iter || !iter->curr || !iter->curr->value) return NULL;
+    return iter->key;
+}
+
+size_t
+rt_frozen_iter_keylen(const rt_frozen_iter *iter)
+{
+    if(!iter || !iter->curr || !iter->curr->value) return 0;
+    return iter->klen;
+}
+
+const void *
+rt_frozen_iter_value(const rt_frozen_iter *iter)
+{
+    if(!iter || !iter->curr) return NULL;
+    return rt_frozen_value(iter->f,iter->curr);
+}
+
+void
+rt_frozen_iter_free(rt_frozen_iter *iter)
+{
+    if(!iter) return;
+    if(iter->stack != iter->istack) iter->f->free(iter->stack);
+    if(iter->key != iter->ikey) iter->f->free(iter->key);
+    if(iter->free) iter->free(iter);
+}
+
+typedef struct {
+    const rt_frozen *fz;
+    void *usr_ctxt;
+    void (*mapfunc)(void *, unsigned char *, size_t, void *);
+    unsigned char *key;         /* ikey, or on the heap for long keys */
+    size_t kcap;
+    unsigned char ikey[MAX_KEY_LENGTH+1];
+} rt_frozen_dfs_state;
+
+static void
+rt_frozen_dfs(rt_frozen_dfs_state *d, const rt_fnode *f, size_t klen)
+{
+    unsigned char *key;
+    size_t len = klen+f->klen;
+    int i;
+    if(len >= d->kcap) {
+        if(!(key = rt_grow(d->key,&d->kcap,len+1,1,d->ikey,
+                        d->fz->malloc,d->fz->free)))
+            return;
+        d->key = key;
+    }
+    memcpy(d->key+klen,FNODE_KEY(f),f->klen);
+    d->key[len] = 0;
+    if(f->value)
+        d->mapfunc(d->usr_ctxt, d->key, len, rt_frozen_value(d->fz,f));
+    for(i=0;i<f->nchild;i++)
+        rt_frozen_dfs(d, rt_fnode_child(f,i), len);
+}
+
+void
+rt_frozen_map(const rt_frozen *fz, void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt, unsigned char *key,
+            size_t klen, void *value))
+{
+    rt_frozen_dfs_state d;
+    if(!mapfunc || !fz) return;
+    d.fz = fz;
+    d.usr_ctxt = usr_ctxt;
+    d.mapfunc = mapfunc;
+    d.key = d.ikey;
+    d.kcap = sizeof(d.ikey);
+    rt_frozen_dfs(&d, (const rt_fnode *)fz->base, 0);
+    if(d.key != d.ikey) fz->free(d.key);
+}
+
+/*
+ * On-disk format: a fixed header followed by the frozen node records,
+ * a table of value offsets and the value bytes. Every section starts
+ * on an 8 byte boundary and all offsets are from the start of the
+ * file, so the file can be mapped anywhere and used in place. Integers
+ * are in host byte order; the endian marker rejects foreign files.
+ *
+ *   rt_file_header
+ *   node records       [nodes, nodes+nodes_size)
+ *   uint64_t voffs[nvalues]  value offsets, relative to blob
+ *   value bytes        [blob, blob+blob_size)
+ *
+ * The header CRC is checked on open. The payload CRC covers everything
+ * after the header; it is only checked by rt_frozen_verify so that
+ * opening does not touch every page.
+ */
+
+#define RT_FILE_MAGIC   "RADIXTRE"
+#define RT_FILE_VERSION 1
+#define RT_FILE_ENDIAN  0x01020304
+#define ALIGN8(x) (((x)+7) & ~(uint64_t)7)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint64_t size;              /* total file size */
+    uint64_t nodes;             /* offset of the node records */
+    uint64_t nodes_size;
+    uint64_t voffs;             /* offset of the value offset table */
+    uint64_t nvalues;
+    uint64_t blob;              /* offset of the value bytes */
+    uint64_t blob_size;
+    uint32_t payload_crc;
+    uint32_t header_crc;        /* computed with this field zeroed */
+} rt_file_header;
+
+static void
+rt_crc32_init(uint32_t *table)
+{
+    uint32_t c;
+    int i, j;
+    for(i=0;i<256;i++) {
+        c = i;
+        for(j=0;j<8;j++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+}
+
+static uint32_t
+rt_crc32(const uint32_t *table, uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    crc = ~crc;
+    while(len--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t
+rt_header_crc(const uint32_t *table, const rt_file_header *hdr)
+{
+    rt_file_header h = *hdr;
+    h.header_crc = 0;
+    return rt_crc32(table,0,&h,sizeof(h));
+}
+
+/* fwrite that also updates the payload CRC */
+static int
+rt_file_write(FILE *fp, const uint32_t *table, uint32_t *crc,
+        const void *buf, size_t len)
+{
+    if(len == 0) return 1;
+    *crc = rt_crc32(table,*crc,buf,len);
+    return fwrite(buf,1,len,fp) == len;
+}
+
+static size_t
+rt_strvlen(const void *value)
+{
+    return strlen(value)+1;
+}
+
+int
+rt_tree_save(const rt_tree *t, const char *path,
+        size_t (*vlen)(const void *value))
+{
+    static const unsigned char zeros[8];
+    uint32_t table[256];
+    rt_file_header hdr;
+    rt_frozen *fz;
+    FILE *fp;
+    uint64_t off;
+    size_t i, len;
+    int ok;
+    if(!t || !path) return 0;
+    if(!vlen) vlen = rt_strvlen;
+    if(!(fz = rt_tree_freeze(t))) return 0;
+    if(!(fp = fopen(path,"wb"))) {
+        rt_frozen_free(fz);
+        return 0;
+    }
+    rt_crc32_init(table);
+
+    memset(&hdr,0,sizeof(hdr));
+    memcpy(hdr.magic,RT_FILE_MAGIC,sizeof(hdr.magic));
+    hdr.version = RT_FILE_VERSION;
+    hdr.endian = RT_FILE_ENDIAN;
+    hdr.nodes = sizeof(hdr);
+    hdr.nodes_size = fz->size;
+    hdr.voffs = hdr.nodes + ALIGN8(fz->size);
+    hdr.nvalues = fz->nvalues;
+    hdr.blob = hdr.voffs + fz->nvalues*sizeof(uint64_t);
+
+    /* placeholder; rewritten once the CRC is known */
+    ok = fwrite(&hdr,1,sizeof(hdr),fp) == sizeof(hdr);
+    ok = ok && rt_file_write(fp,table,&hdr.payload_crc,fz->base,fz->size);
+    ok = ok && rt_file_write(fp,table,&hdr.payload_crc,zeros,
+            ALIGN8(fz->size)-fz->size);
+    for(i=0, off=0; ok && i<fz->nvalues; i++) {
+        ok = rt_file_write(fp,table,&hdr.payload_crc,&off,sizeof(off));
+        off += ALIGN8(vlen(fz->values[i]));
+    }
+    for(i=0; ok && i<fz->nvalues; i++) {
+        len = vlen(fz->values[i]);
+        ok = rt_file_write(fp,table,&hdr.payload_crc,fz->values[i],len)
+            && rt_file_write(fp,table,&hdr.payload_crc,zeros,
+                    ALIGN8(len)-len);
+    }
+    hdr.blob_size = off;
+    hdr.size = hdr.blob + off;
+    hdr.header_crc = rt_header_crc(table,&hdr);
+
+    ok = ok && fseek(fp,0,SEEK_SET) == 0
+        && fwrite(&hdr,1,sizeof(hdr),fp) == sizeof(hdr);
+    if(fclose(fp) != 0) ok = 0;
+    rt_frozen_free(fz);
+    if(!ok) remove(path);
+    return ok;
+}
+
+/* Check the header of a mapping of @a size bytes */
+static int
+rt_file_check(const rt_file_header *hdr, size_t size)
+{
+    uint32_t table[256];
+    if(size < sizeof(*hdr)) return 0;
+    if(memcmp(hdr->magic,RT_FILE_MAGIC,sizeof(hdr->magic))
+            || hdr->endian != RT_FILE_ENDIAN
+            || hdr->version != RT_FILE_VERSION)
+        return 0;
+    rt_crc32_init(table);
+    if(rt_header_crc(table,hdr) != hdr->header_crc) return 0;
+    /* the sections must tile the file exactly */
+    return hdr->size == size
+        && hdr->nodes == sizeof(*hdr)
+        && hdr->nodes_size >= FNODE_SIZE(0,0)
+        && hdr->nodes_size <= UINT32_MAX
+        && hdr->voffs == hdr->nodes + ALIGN8(hdr->nodes_size)
+        && hdr->voffs <= size
+        && hdr->nvalues <= (size - hdr->voffs)/sizeof(uint64_t)
+        && hdr->blob == hdr->voffs + hdr->nvalues*sizeof(uint64_t)
+        && hdr->blob_size == size - hdr->blob;
+}
+
+rt_frozen *
+rt_tree_open_mmap(const char *path)
+{
+    const rt_file_header *hdr;
+    rt_frozen *fz;
+    struct stat st;
+    void *map;
+    int fd;
+    if(!path) return NULL;
+
+    if((fd = open(path,O_RDONLY)) < 0) return NULL;
+    if(fstat(fd,&st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if(map == MAP_FAILED) return NULL;
+
+    hdr = map;
+    if(!rt_file_check(hdr,st.st_size) || !(fz = malloc(sizeof(*fz)))) {
+        munmap(map,st.st_size);
+        return NULL;
+    }
+    fz->base = (const unsigned char *)map + hdr->nodes;
+    fz->size = hdr->nodes_size;
+    fz->values = NULL;
+    fz->nvalues = hdr->nvalues;
+    fz->voffs = (const uint64_t *)((const unsigned char *)map + hdr->voffs);
+    fz->blob = (const unsigned char *)map + hdr->blob;
+    fz->map = map;
+    fz->maplen = st.st_size;
+    fz->malloc = malloc;
+    fz->free = free;
+    return fz;
+}
+
+int
+rt_frozen_verify(const rt_frozen *fz)
+{
+    const rt_file_header *hdr;
+    uint32_t table[256];
+    if(!fz) return 0;
+    if(!fz->map) return 1;
+    hdr = fz->map;
+    rt_crc32_init(table);
+    return rt_crc32(table,0,(const unsigned char *)fz->map+sizeof(*hdr),
+            fz->maplen-sizeof(*hdr)) == hdr->payload_crc;
+}
+
+/*
+ * Sharded trees
+ *
+ * Keys are spread over independent trees by a hash of their first one
+ * or two bytes, and each tree is guarded by its own reader-writer lock,
+ * so that threads working on different shards do not contend. All keys
+ * sharing those first bytes live in the same shard: a prefix at least
+ * that long is iterated in that shard alone, shorter ones merge the
+ * iterators of all shards in key order.
+ */
+
+#define SHARD_PAD (64 - (sizeof(pthread_rwlock_t)+sizeof(rt_tree *))%64)
+
+typedef struct {
+    pthread_rwlock_t lock;
+    rt_tree *t;
+    char pad[SHARD_PAD];        /* keep the locks a cache line apart */
+} rt_shard;
+
+struct _rt_sharded_tree {
+    void * (* malloc)(size_t);
+    void (*free)(void *);
+    unsigned int nshards;
+    unsigned int nbytes;        /* key bytes selecting the shard */
+    rt_shard *shards;
+};
+
+struct _rt_sharded_iter {
+    rt_sharded_tree *s;
+    unsigned int lo, hi;        /* read locked shards */
+    unsigned int n;             /* iterators left in the heap */
+    int started;
+    rt_iter_storage *its;       /* storage of the shard iterators */
+    struct {
+        rt_iter *it;
+        const unsigned char *key;
+        size_t klen;
+    } heap[];                   /* shard iterators, smallest key first */
+};
+
+static rt_shard *
+rt_shard_of(const rt_sharded_tree *s, const unsigned char *key, size_t lkey)
+{
+    uint32_t h = key[0];
+    if(s->nbytes > 1) h = h<<8 | (lkey > 1 ? key[1] : 0);
+    return &s->shards[((h*0x9E3779B1u) >> 8) % s->nshards];
+}
+
+rt_sharded_tree *
+rt_sharded_new(unsigned int albet_size, void (*_vfree)(void*),
+        unsigned int nshards, unsigned int nbytes, unsigned int flags)
+{
+    rt_sharded_tree *s;
+    unsigned int i;
+    if(nshards < 1 || nbytes < 1 || nbytes > 2) return NULL;
+    s = malloc(sizeof(*s));
+    if(!s) return NULL;
+    s->malloc = malloc;
+    s->free = free;
+    s->nshards = nshards;
+    s->nbytes = nbytes;
+    s->shards = malloc(nshards*sizeof(rt_shard));
+    if(!s->shards) {
+        free(s);
+        return NULL;
+    }
+    for(i=0;i<nshards;i++) {
+        s->shards[i].t = rt_tree_new_flags(albet_size,_vfree,flags);
+        if(!s->shards[i].t) break;
+        pthread_rwlock_init(&s->shards[i].lock,NULL);
+    }
+    if(i < nshards) {
+        s->nshards = i;
+        rt_sharded_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void
+rt_sharded_free(rt_sharded_tree *s)
+{
+    unsigned int i;
+    if(!s) return;
+    for(i=0;i<s->nshards;i++) {
+        pthread_rwlock_destroy(&s->shards[i].lock);
+        rt_tree_free(s->shards[i].t);
+    }
+    s->free(s->shards);
+    s->free(s);
+}
+
+int
+rt_sharded_set(rt_sharded_tree *s, const unsigned char *key,
+        size_t lkey, void *value)
+{
+    rt_shard *sh;
+    int ret;
+    if(!s || !key || lkey < 1) return 0;
+    sh = rt_shard_of(s,key,lkey);
+    pthread_rwlock_wrlock(&sh->lock);
+    ret = rt_tree_set(sh->t,key,lkey,value);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+void *
+rt_sharded_setdefault(rt_sharded_tree *s, const unsigned char *key,
+        size_t lkey, void *value)
+{
+    rt_shard *sh;
+    void *ret;
+    if(!s || !key || lkey < 1) return NULL;
+    sh = rt_shard_of(s,key,lkey);
+    pthread_rwlock_wrlock(&sh->lock);
+    ret = rt_tree_setdefault(sh->t,key,lkey,value);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+void *
+rt_sharded_get(rt_sharded_tree *s, const unsigned char *key, size_t lkey)
+{
+    rt_shard *sh;
+    void *ret;
+    if(!s || !key || lkey < 1) return NULL;
+    sh = rt_shard_of(s,key,lkey);
+    pthread_rwlock_rdlock(&sh->lock);
+    ret = rt_tree_get(sh->t,key,lkey);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+int
+rt_sharded_remove(rt_sharded_tree *s, const unsigned char *key, size_t lkey)
+{
+    rt_shard *sh;
+    int ret;
+    if(!s || !key || lkey < 1) return 0;
+    sh = rt_shard_of(s,key,lkey);
+    pthread_rwlock_wrlock(&sh->lock);
+    ret = rt_tree_remove(sh->t,key,lkey);
+    pthread_rwlock_unlock(&sh->lock);
+    return ret;
+}
+
+#define HEAP_LESS(iter,a,b) \
+    (rt_key_cmp((iter)->heap[a].key,(iter)->heap[a].klen, \
+                (iter)->heap[b].key,(iter)->heap[b].klen) < 0)
+
+/* Restore the heap order after the key of heap[i] grew */
+static void
+rt_sharded_sift(rt_sharded_iter *iter, unsigned int i)
+{
+    rt_iter *it;
+    const unsigned char *key;
+    size_t klen;
+    unsigned int c;
+    while((c = 2*i+1) < iter->n) {
+        if(c+1 < iter->n && HEAP_LESS(iter,c+1,c)) c++;
+        if(!HEAP_LESS(iter,c,i)) break;
+        it = iter->heap[i].it;
+        key = iter->heap[i].key;
+        klen = iter->heap[i].klen;
+        iter->heap[i] = iter->heap[c];
+        iter->heap[c].it = it;
+        iter->heap[c].key = key;
+        iter->heap[c].klen = klen;
+        i = c;
+    }
+}
+
+rt_sharded_iter *
+rt_sharded_prefix(rt_sharded_tree *s, const unsigned char *prefix,
+        size_t prefixlen)
+{
+    rt_sharded_iter *iter;
+    rt_iter *it;
+    unsigned int i;
+    if(!s) return NULL;
+
+    iter = s->malloc(sizeof(*iter) + s->nshards*sizeof(iter->heap[0]));
+    if(!iter) return NULL;
+    iter->s = s;
+    iter->n = 0;
+    iter->started = 0;
+    if(prefix && prefixlen >= s->nbytes) {
+        iter->lo = rt_shard_of(s,prefix,prefixlen) - s->shards;
+        iter->hi = iter->lo+1;
+    } else {
+        iter->lo = 0;
+        iter->hi = s->nshards;
+    }
+    iter->its = s->malloc((iter->hi-iter->lo)*sizeof(*iter->its));
+    if(!iter->its) {
+        s->free(iter);
+        return NULL;
+    }
+
+    /* the shards stay read locked, in order, until rt_sharded_iter_free */
+    for(i=iter->lo;i<iter->hi;i++) {
+        pthread_rwlock_rdlock(&s->shards[i].lock);
+        it = rt_iter_init(&iter->its[i-iter->lo],s->shards[i].t,
+                prefix,prefixlen);
+        if(rt_iter_next(it)) {
+            iter->heap[iter->n].it = it;
+            iter->heap[iter->n].key = rt_iter_key(it);
+            iter->heap[iter->n++].klen = rt_iter_keylen(it);
+        } else rt_iter_free(it);
+    }
+    for(i=iter->n/2;i-- > 0;)
+        rt_sharded_sift(iter,i);
+    return iter;
+}
+
+int
+rt_sharded_iter_next(rt_sharded_iter *iter)
+{
+    if(!iter || !iter->n) return 0;
+    if(!iter->started) {
+        iter->started = 1;
+        return 1;
+    }
+    if(rt_iter_next(iter->heap[0].it)) {
+        iter->heap[0].key = rt_iter_key(iter->heap[0].it);
+        iter->heap[0].klen = rt_iter_keylen(iter->heap[0].it);
+    } else {
+        rt_iter_free(iter->heap[0].it);
+        iter->heap[0] = iter->heap[--iter->n];
+    }
+    rt_sharded_sift(iter,0);
+    return iter->n > 0;
+}
+
+const unsigned char *
+rt_sharded_iter_key(const rt_sharded_iter *iter)
+{
+    if(!iter || !iter->n || !iter->started) return NULL;
+    return iter->heap[0].key;
+}
 
-    rt_node_dfs(n, key, 0, usr_ctxt, mapfunc);
+size_t
+rt_sharded_iter_keylen(const rt_sharded_iter *iter)
+{
+    if(!iter || !iter->n || !iter->started) return 0;
+    return iter->heap[0].klen;
+}
+
+const void *
+rt_sharded_iter_value(const rt_sharded_iter *iter)
+{
+    if(!iter || !iter->n || !iter->started) return NULL;
+    return rt_iter_value(iter->heap[0].it);
 }
 
+void
+rt_sharded_iter_free(rt_sharded_iter *iter)
+{
+    unsigned int i;
+    if(!iter) return;
+    for(i=0;i<iter->n;i++)
+        rt_iter_free(iter->heap[i].it);
+    for(i=iter->lo;i<iter->hi;i++)
+        pthread_rwlock_unlock(&iter->s->shards[i].lock);
+    iter->s->free(iter->its);
+    iter->s->free(iter);
+}
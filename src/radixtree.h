@@ -20,7 +20,6 @@
  * @brief The exposed radixtree functions
  *
  * @todo map functionality (run method on every node)
- * @todo support multiple wildcards in search
  * @todo figure out how to handle key validation/modification -- keys with "illegal" chars; key.lower(); key.upper()
  */
 
@@ -43,27 +42,82 @@ extern "C" {
  * @def MAX_ALPHABET_SIZE
  *
  * The maximum alphabet size of the rt_tree node keys.
- * This is used to place an upper bound on the node leaf size
+ * This is used to place an upper bound on the node leaf size; at 256
+ * a node can have a child for every byte value, so any binary keys
+ * can be stored.
  */
-#define MAX_ALPHABET_SIZE 128
+#define MAX_ALPHABET_SIZE 256
 
 /**
  * @def MAX_KEY_LENGTH
  *
- * The maximum key length for a single key.
- * This bounds the rt_tree depth and search space.
+ * The longest key iterators and the map functions hold without
+ * allocating. Keys are arbitrary bytes, including NUL, of any length;
+ * longer keys just move the key buffers to the heap.
  */
 #define MAX_KEY_LENGTH 128
 
+/**
+ * @def RT_FLAG_ARENA
+ *
+ * Allocate the tree nodes from a private slab arena instead of
+ * individual malloc calls. Freed nodes are recycled within the tree
+ * and rt_tree_free releases the whole arena at once.
+ */
+#define RT_FLAG_ARENA 0x01
+
+/**
+ * @def RT_FLAG_CONCURRENT
+ *
+ * Allow lookups, prefix iteration and rt_tree_map to run without locks
+ * while other threads change the tree. Writers may run concurrently as
+ * well: each change locks only the node it replaces and that node's
+ * parent. Nodes that readers may see are never edited in place: the
+ * writer publishes a changed copy with a single atomic store, and
+ * replaced nodes are freed once no thread can hold them any more.
+ * rt_tree_print, rt_tree_freeze and rt_tree_save need the writers to be
+ * idle. Each thread inside the tree, or holding open iterators on it,
+ * takes one of 128 reader slots however many iterators it holds; past
+ * 128 such threads, further threads wait until a slot is given back.
+ */
+#define RT_FLAG_CONCURRENT 0x02
+
+/**
+ * @def RT_FLAG_COUNT
+ *
+ * Keep the number of values below every node up to date on insert and
+ * remove, at O(depth) extra cost, so that rt_tree_count_prefix,
+ * rt_tree_rank and rt_tree_select take O(depth x fanout) time instead
+ * of visiting the subtrees they count. The counts share the node lock
+ * words, so this cannot be combined with RT_FLAG_CONCURRENT.
+ */
+#define RT_FLAG_COUNT 0x04
+
 typedef struct _rt_tree rt_tree;
 typedef struct _rt_iter rt_iter;
+typedef struct _rt_frozen rt_frozen;
+typedef struct _rt_frozen_iter rt_frozen_iter;
+typedef struct _rt_sharded_tree rt_sharded_tree;
+typedef struct _rt_sharded_iter rt_sharded_iter;
+typedef struct _rt_dfa rt_dfa;
 
 rt_tree * rt_tree_new(
-        uint8_t albet_size,
+        unsigned int albet_size,
         void (*_vfree)(void*));
 
+/**
+ * @def rt_tree_new_flags
+ *
+ * Creates a radixtree using the system allocator and the
+ * RT_FLAG_* options in @a flags
+ */
+rt_tree * rt_tree_new_flags(
+        unsigned int albet_size,
+        void (*_vfree)(void*),
+        unsigned int flags);
+
 rt_tree * rt_tree_malloc(
-        uint8_t albet_size,
+        unsigned int albet_size,
         void (*_vfree)(void*),
         void* (*_malloc)(size_t),
         void* (*_realloc)(void *,size_t),
@@ -76,18 +130,88 @@ void * rt_tree_get(
         const unsigned char *key,
         size_t lkey);
 
-int rt_tree_set(
+/**
+ * @def rt_tree_longest_prefix
+ *
+ * Finds the longest key in @a t that is a prefix of @a key (or @a key
+ * itself), e.g. the most specific route for a path, in one walk down
+ * the tree.
+ * @param matched Receives the length of that key, or 0 if there is
+ * none; may be NULL
+ *
+ * @returns its value, or NULL if no prefix of @a key is in the tree
+ */
+void * rt_tree_longest_prefix(
+        const rt_tree *t,
+        const unsigned char *key,
+        size_t lkey,
+        size_t *matched);
+
+/**
+ * @def rt_tree_get_batch
+ *
+ * Looks up @a n keys at once, interleaving the lookups and prefetching
+ * the nodes each one visits next so that their cache misses overlap.
+ * @param t The radixtree to search
+ * @param keys The keys to look up
+ * @param lens The lengths of the keys
+ * @param n The number of keys
+ * @param out Receives the value for each key, or NULL if not found
+ */
+void rt_tree_get_batch(
         const rt_tree *t,
+        const unsigned char **keys,
+        const size_t *lens,
+        size_t n,
+        void **out);
+
+int rt_tree_set(
+        rt_tree *t,
         const unsigned char *key,
         size_t lkey,
         void *value);
 
 void * rt_tree_setdefault(
-        const rt_tree *t,
+        rt_tree *t,
         const unsigned char *key,
         size_t lkey,
         void *value);
 
+/**
+ * @def rt_tree_build_sorted
+ *
+ * Loads @a n keys into the empty radixtree @a t in one pass. The keys
+ * must be sorted (shorter keys before their extensions); for duplicate
+ * keys the last value wins. Every node is allocated once at its final
+ * size, which is much faster than repeated rt_tree_set calls.
+ * @param t An empty radixtree
+ * @param keys The keys, in ascending order
+ * @param lens The lengths of the keys
+ * @param values The values; none may be NULL
+ * @param n The number of keys
+ *
+ * @returns 1 on success; 0 if the input is invalid or unsorted, the
+ * tree is not empty, or memory ran out (the tree is left unchanged)
+ */
+int rt_tree_build_sorted(
+        rt_tree *t,
+        const unsigned char **keys,
+        const size_t *lens,
+        void **values,
+        size_t n);
+
+/**
+ * @def rt_tree_build
+ *
+ * Same as rt_tree_build_sorted, but sorts the keys first
+ */
+int rt_tree_build(
+        rt_tree *t,
+        const unsigned char **keys,
+        const size_t *lens,
+        void **values,
+        size_t n);
+
 /**
  * @def rt_tree_remove
  *
@@ -99,21 +223,207 @@ void * rt_tree_setdefault(
  * @returns 1 if the key was successfully removed; 0 otherwise
  */
 int rt_tree_remove(
-        const rt_tree *t,
+        rt_tree *t,
         const unsigned char *key,
         size_t lkey);
 
 void rt_tree_print(const rt_tree *t);
 
+/**
+ * @def rt_tree_synchronize
+ *
+ * Waits until every reader of the RT_FLAG_CONCURRENT tree @a t that
+ * started before the call has finished, and frees the nodes the writers
+ * replaced so far. After it returns, no reader can still see a value
+ * that was removed or overwritten before the call, so the caller may
+ * free it. Iterators pin the tree until they are freed; the calling
+ * thread must not hold one.
+ * @param t The radixtree
+ */
+void rt_tree_synchronize(rt_tree *t);
+
 rt_iter *rt_tree_prefix(
         const rt_tree *t,
         const unsigned char *prefix,
         size_t prefixlen);
 
+/**
+ * @def RT_ITER_DESC
+ *
+ * Iterate in descending key order: rt_iter_next yields the largest key
+ * first and rt_iter_prev walks back up. The last N keys cost about as
+ * much as the first N.
+ */
+#define RT_ITER_DESC 0x10
+
+/**
+ * @def rt_tree_prefix_flags
+ *
+ * Like rt_tree_prefix, with RT_ITER_* options in @a flags
+ */
+rt_iter *rt_tree_prefix_flags(
+        const rt_tree *t,
+        const unsigned char *prefix,
+        size_t prefixlen,
+        unsigned int flags);
+
+/**
+ * @def RT_SEEK_GE
+ *
+ * rt_tree_seek modes: start at the first key greater than or equal to
+ * (RT_SEEK_GE), or greater than (RT_SEEK_GT) the given key, or at the
+ * last key less than or equal to (RT_SEEK_LE), or less than
+ * (RT_SEEK_LT) it
+ */
+#define RT_SEEK_GE 0
+#define RT_SEEK_GT 1
+#define RT_SEEK_LE 2
+#define RT_SEEK_LT 3
+
+/**
+ * @def rt_tree_seek
+ *
+ * Returns an iterator whose first rt_iter_next yields the key chosen by
+ * @a mode (see RT_SEEK_GE), found in one walk down the path of @a key;
+ * further calls continue in key order through the rest of the tree,
+ * in descending order if RT_ITER_DESC is or'ed into @a mode. There is
+ * no first key if the chosen one does not exist.
+ *
+ * @returns the iterator, or NULL on error
+ */
+rt_iter *rt_tree_seek(
+        const rt_tree *t,
+        const unsigned char *key,
+        size_t lkey,
+        int mode);
+
+/**
+ * @def rt_tree_range
+ *
+ * Iterates over the keys from @a lo (inclusive) up to @a hi
+ * (exclusive), in key order; it ends at the first key not below
+ * @a hi. A NULL @a lo starts at the first key, a NULL @a hi runs to
+ * the end of the tree.
+ *
+ * @returns the iterator, or NULL on error
+ */
+rt_iter *rt_tree_range(
+        const rt_tree *t,
+        const unsigned char *lo,
+        size_t llo,
+        const unsigned char *hi,
+        size_t lhi);
+
+/**
+ * @def rt_tree_count_prefix
+ *
+ * Returns the number of keys starting with @a prefix; an empty prefix
+ * counts the whole tree. See RT_FLAG_COUNT.
+ */
+size_t rt_tree_count_prefix(
+        const rt_tree *t,
+        const unsigned char *prefix,
+        size_t prefixlen);
+
+/**
+ * @def rt_tree_rank
+ *
+ * Returns the number of keys less than @a key, which need not be in
+ * the tree. See RT_FLAG_COUNT.
+ */
+size_t rt_tree_rank(
+        const rt_tree *t,
+        const unsigned char *key,
+        size_t lkey);
+
+/**
+ * @def rt_tree_select
+ *
+ * Returns an iterator whose first rt_iter_next yields the key of rank
+ * @a k, the first key being rank 0; further calls continue in key
+ * order. There is no first key if the tree holds no more than @a k
+ * keys. See RT_FLAG_COUNT.
+ *
+ * @returns the iterator, or NULL on error
+ */
+rt_iter *rt_tree_select(
+        const rt_tree *t,
+        size_t k);
+
+/**
+ * @def RT_ITER_DEPTH
+ *
+ * Iterators hold the nodes of up to RT_ITER_DEPTH levels and keys of up
+ * to RT_ITER_KEYLEN - 1 bytes inline; deeper paths and longer keys move
+ * to the heap as they are met.
+ */
+#define RT_ITER_DEPTH 16
+#define RT_ITER_KEYLEN 64
+
+/**
+ * @def RT_ITER_SIZE
+ *
+ * The number of bytes rt_iter_init needs: up to 128 bytes of fields,
+ * a 24 byte stack frame per level and the key buffer (on LP64; other
+ * data models need less). rt_iter_size returns the exact size, which
+ * may be smaller. The build fails if an iterator does not fit.
+ */
+#define RT_ITER_SIZE (128 + 24*RT_ITER_DEPTH + RT_ITER_KEYLEN)
+
+/**
+ * @def rt_iter_storage
+ *
+ * Suitably sized and aligned storage for rt_iter_init, e.g. on the
+ * stack
+ */
+typedef union {
+    void *align;
+    unsigned char bytes[RT_ITER_SIZE];
+} rt_iter_storage;
+
+size_t rt_iter_size(void);
+
+/**
+ * @def rt_iter_init
+ *
+ * Like rt_tree_prefix, but builds the iterator in the caller's
+ * @a storage (see rt_iter_storage) instead of allocating it. It must
+ * still be passed to rt_iter_free, which releases it without freeing
+ * the storage; the storage can then be reused for another iterator.
+ * @param storage At least rt_iter_size() bytes, aligned for a pointer
+ *
+ * @returns the iterator, at @a storage; NULL on error
+ */
+rt_iter *rt_iter_init(
+        void *storage,
+        const rt_tree *t,
+        const unsigned char *prefix,
+        size_t prefixlen);
+
 int rt_iter_next(rt_iter *iter);
 
+/**
+ * @def rt_iter_prev
+ *
+ * Steps @a iter back to the key before the current one, against the
+ * direction of rt_iter_next. The two can be mixed freely. Past either
+ * end the iterator stays there; a step the other way comes back.
+ *
+ * @returns 1 if there is such a key, 0 otherwise
+ */
+int rt_iter_prev(rt_iter *iter);
+
+/**
+ * @def rt_iter_key
+ *
+ * The key of the current entry, NUL terminated for convenience; keys
+ * may hold NUL bytes themselves, see rt_iter_keylen. It is valid until
+ * the next call to rt_iter_next or rt_iter_free.
+ */
 const unsigned char *rt_iter_key(const rt_iter *iter);
 
+size_t rt_iter_keylen(const rt_iter *iter);
+
 const void *rt_iter_value(const rt_iter *iter);
 
 void rt_iter_free(rt_iter *iter);
@@ -126,6 +436,302 @@ void rt_tree_map(
             size_t klen,
             void *value));
 
+/**
+ * @def RT_MAP_ORDERED
+ *
+ * rt_tree_map_parallel option: give each worker thread one contiguous
+ * key range and map it in lexicographic order, so that the calls made
+ * by any one thread come sorted. There is no work stealing then.
+ */
+#define RT_MAP_ORDERED 0x01
+
+/**
+ * @def rt_tree_map_parallel
+ *
+ * Like rt_tree_map, but splits the tree into subtrees that @a nthreads
+ * threads (including the calling one) map in parallel, stealing work
+ * from each other. @a mapfunc is called from all of them at once, and
+ * each thread passes its own key buffer. Without RT_MAP_ORDERED the
+ * order of the calls is unspecified.
+ * @param nthreads The number of threads; 0 or 1 maps in the caller
+ * @param flags RT_MAP_* options
+ */
+void rt_tree_map_parallel(
+        rt_tree *tree,
+        unsigned int nthreads,
+        unsigned int flags,
+        void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt,
+            unsigned char *key,
+            size_t klen,
+            void *value));
+
+/**
+ * @def rt_tree_match
+ *
+ * Calls @a mapfunc, like rt_tree_map, for every key matching the glob
+ * @a pattern, in key order. '?' matches any one byte, '*' any run of
+ * bytes and a bracket expression such as "[a-z_]" or "[!0-9]" one byte
+ * of (or not of) the listed set; a backslash makes the next byte
+ * literal. Keys are matched as a whole, and nothing below a node is
+ * visited once the pattern cannot match any key there.
+ * @param plen The pattern length; patterns may hold any byte
+ *
+ * @returns 1 on success, 0 on error or if a bracket is not closed
+ */
+int rt_tree_match(
+        const rt_tree *t,
+        const unsigned char *pattern,
+        size_t plen,
+        void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt,
+            unsigned char *key,
+            size_t klen,
+            void *value));
+
+/**
+ * @def RT_FUZZY_DAMERAU
+ *
+ * rt_tree_fuzzy option: count swapping two adjacent bytes as a single
+ * edit (optimal string alignment distance)
+ */
+#define RT_FUZZY_DAMERAU 0x01
+
+/**
+ * @def rt_tree_fuzzy
+ *
+ * Calls @a mapfunc, like rt_tree_map, for every key within Levenshtein
+ * distance @a max_dist of @a key, in key order: every key that takes no
+ * more than @a max_dist byte insertions, deletions and substitutions
+ * to turn into @a key. Subtrees that are already too far off are not
+ * visited.
+ * @param flags RT_FUZZY_* options
+ *
+ * @returns 1 on success, 0 on error
+ */
+int rt_tree_fuzzy(
+        const rt_tree *t,
+        const unsigned char *key,
+        size_t lkey,
+        unsigned int max_dist,
+        unsigned int flags,
+        void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt,
+            unsigned char *key,
+            size_t klen,
+            void *value));
+
+/**
+ * @def rt_dfa_new
+ *
+ * Compiles the regular expression @a regex into a DFA for
+ * rt_tree_intersect. The syntax is a subset of POSIX extended regular
+ * expressions: literal bytes, '.', bracket expressions such as
+ * "[a-z_]" or "[^0-9]", grouping with '(' ')', alternation with '|' and
+ * the '*', '+' and '?' operators. A backslash makes the next byte
+ * literal, in bracket expressions too. The expression has to match the
+ * whole key, there are no anchors.
+ * @param len The expression length; it may hold any byte
+ *
+ * @returns the DFA, or NULL on a syntax error, if it needs too many
+ * states or if out of memory
+ */
+rt_dfa *rt_dfa_new(
+        const unsigned char *regex,
+        size_t len);
+
+void rt_dfa_free(rt_dfa *dfa);
+
+/**
+ * @def rt_tree_intersect
+ *
+ * Calls @a mapfunc, like rt_tree_map, for every key that @a dfa
+ * accepts, in key order. The DFA runs along the tree in a single
+ * depth-first search and leaves every subtree as soon as no key in it
+ * can be accepted. A DFA can be used by any number of threads at once.
+ *
+ * @returns 1 on success, 0 on error
+ */
+int rt_tree_intersect(
+        const rt_tree *t,
+        const rt_dfa *dfa,
+        void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt,
+            unsigned char *key,
+            size_t klen,
+            void *value));
+
+/**
+ * @def rt_tree_freeze
+ *
+ * Creates an immutable, compact copy of the radixtree @a t. The nodes
+ * are packed into one contiguous buffer in depth-first order, using
+ * relative offsets instead of pointers. The values are shared with
+ * @a t and are not freed by rt_frozen_free.
+ * @param t The radixtree to freeze; it is not modified
+ *
+ * @returns the frozen tree, or NULL on error
+ */
+rt_frozen *rt_tree_freeze(const rt_tree *t);
+
+void rt_frozen_free(rt_frozen *f);
+
+/**
+ * @def rt_frozen_size
+ *
+ * @returns the number of bytes used by the frozen tree @a f
+ */
+size_t rt_frozen_size(const rt_frozen *f);
+
+void * rt_frozen_get(
+        const rt_frozen *f,
+        const unsigned char *key,
+        size_t lkey);
+
+void * rt_frozen_longest_prefix(
+        const rt_frozen *f,
+        const unsigned char *key,
+        size_t lkey,
+        size_t *matched);
+
+rt_frozen_iter *rt_frozen_prefix(
+        const rt_frozen *f,
+        const unsigned char *prefix,
+        size_t prefixlen);
+
+int rt_frozen_iter_next(rt_frozen_iter *iter);
+
+const unsigned char *rt_frozen_iter_key(const rt_frozen_iter *iter);
+
+size_t rt_frozen_iter_keylen(const rt_frozen_iter *iter);
+
+const void *rt_frozen_iter_value(const rt_frozen_iter *iter);
+
+void rt_frozen_iter_free(rt_frozen_iter *iter);
+
+void rt_frozen_map(
+        const rt_frozen *f,
+        void *usr_ctxt,
+        void (*mapfunc)(void *usr_ctxt,
+            unsigned char *key,
+            size_t klen,
+            void *value));
+
+/**
+ * @def rt_tree_save
+ *
+ * Writes the radixtree @a t to the file @a path in a versioned,
+ * checksummed format that rt_tree_open_mmap can use in place. The
+ * value bytes are copied into the file.
+ * @param t The radixtree to save
+ * @param path The file to write; it is replaced
+ * @param vlen Returns the number of bytes to store for a value; if NULL
+ * the values are taken to be NUL-terminated strings
+ *
+ * @returns 1 on success; 0 on error (the file is removed)
+ */
+int rt_tree_save(
+        const rt_tree *t,
+        const char *path,
+        size_t (*vlen)(const void *value));
+
+/**
+ * @def rt_tree_open_mmap
+ *
+ * Maps a file written by rt_tree_save read-only and returns it as a
+ * frozen tree. Nothing is deserialized: lookups read the mapped pages
+ * directly, and processes mapping the same file share it through the
+ * page cache. Values point into the mapping (8 byte aligned) and must
+ * not be written to; they stay valid until rt_frozen_free.
+ * Only the file header is checked; see rt_frozen_verify.
+ * @param path The file to open
+ *
+ * @returns the frozen tree, or NULL if the file cannot be mapped or was
+ * written by another version or byte order
+ */
+rt_frozen *rt_tree_open_mmap(const char *path);
+
+/**
+ * @def rt_frozen_verify
+ *
+ * Checks the payload checksum of a tree opened with rt_tree_open_mmap.
+ * This reads the whole file.
+ *
+ * @returns 1 if the data is intact (always for rt_tree_freeze copies);
+ * 0 otherwise
+ */
+int rt_frozen_verify(const rt_frozen *f);
+
+/**
+ * @def rt_sharded_new
+ *
+ * Creates a sharded radixtree: the keys are spread over @a nshards
+ * independent radixtrees by their first @a nbytes bytes, each guarded
+ * by its own reader-writer lock. Threads working on different shards
+ * run in parallel. Iteration returns the keys of all shards in order.
+ * @param nshards The number of shards
+ * @param nbytes The number of leading key bytes that select the shard:
+ * 1 or 2
+ * @param flags RT_FLAG_* options for each shard; with RT_FLAG_ARENA,
+ * every shard gets its own allocator
+ *
+ * @returns the sharded tree, or NULL on error
+ */
+rt_sharded_tree *rt_sharded_new(
+        unsigned int albet_size,
+        void (*_vfree)(void*),
+        unsigned int nshards,
+        unsigned int nbytes,
+        unsigned int flags);
+
+void rt_sharded_free(rt_sharded_tree *s);
+
+int rt_sharded_set(
+        rt_sharded_tree *s,
+        const unsigned char *key,
+        size_t lkey,
+        void *value);
+
+void *rt_sharded_setdefault(
+        rt_sharded_tree *s,
+        const unsigned char *key,
+        size_t lkey,
+        void *value);
+
+void * rt_sharded_get(
+        rt_sharded_tree *s,
+        const unsigned char *key,
+        size_t lkey);
+
+int rt_sharded_remove(
+        rt_sharded_tree *s,
+        const unsigned char *key,
+        size_t lkey);
+
+/**
+ * @def rt_sharded_prefix
+ *
+ * Iterates the keys starting with @a prefix, in key order. A prefix of
+ * at least the shard selecting bytes reads a single shard; shorter ones
+ * merge all shards. The shards read stay locked against writers until
+ * rt_sharded_iter_free, so the calling thread must not change the tree
+ * while it holds the iterator.
+ */
+rt_sharded_iter *rt_sharded_prefix(
+        rt_sharded_tree *s,
+        const unsigned char *prefix,
+        size_t prefixlen);
+
+int rt_sharded_iter_next(rt_sharded_iter *iter);
+
+const unsigned char *rt_sharded_iter_key(const rt_sharded_iter *iter);
+
+size_t rt_sharded_iter_keylen(const rt_sharded_iter *iter);
+
+const void *rt_sharded_iter_value(const rt_sharded_iter *iter);
+
+void rt_sharded_iter_free(rt_sharded_iter *iter);
+
 #ifdef __cplusplus
 }
 #endif
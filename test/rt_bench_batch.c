@@ -0,0 +1,98 @@
+
+/*
+ * Copyright 2012 William Heinbockel
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares lookup throughput of rt_tree_get_batch against a plain loop
+ * of rt_tree_get calls on a tree with random keys.
+ *
+ * usage: rt_bench_batch [nkeys] [batch size]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "radixtree.h"
+
+#define KEYLEN 16
+#define NLOOKUPS (4*1024*1024)
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+    rt_tree *t;
+    size_t nkeys = 1000000, batch = 256, i, j, found = 0;
+    unsigned char *keys;
+    const unsigned char **kp;
+    size_t *lens;
+    void **out;
+    double t0, tget, tbatch;
+
+    if(argc > 1) nkeys = strtoul(argv[1],NULL,10);
+    if(argc > 2) batch = strtoul(argv[2],NULL,10);
+    if(nkeys < 1 || batch < 1) return (-1);
+
+    keys = malloc(nkeys*KEYLEN);
+    kp = malloc(NLOOKUPS*sizeof(*kp));
+    lens = malloc(NLOOKUPS*sizeof(*lens));
+    out = malloc(batch*sizeof(*out));
+    t = rt_tree_new(64,NULL);
+    if(!keys || !kp || !lens || !out || !t) {
+        printf("ERROR: Could not allocate benchmark data... Exiting\n");
+        return (-1);
+    }
+
+    srand(1);
+    for(i=0;i<nkeys;i++) {
+        for(j=0;j<KEYLEN;j++) keys[i*KEYLEN+j] = '0'+rand()%64;
+        rt_tree_set(t,keys+i*KEYLEN,KEYLEN,keys+i*KEYLEN);
+    }
+    for(i=0;i<NLOOKUPS;i++) {
+        kp[i] = keys + (rand()%nkeys)*KEYLEN;
+        lens[i] = KEYLEN;
+    }
+
+    t0 = now();
+    for(i=0;i<NLOOKUPS;i++)
+        if(rt_tree_get(t,kp[i],lens[i])) found++;
+    tget = now()-t0;
+
+    t0 = now();
+    for(i=0;i<NLOOKUPS;i+=batch) {
+        j = NLOOKUPS-i < batch ? NLOOKUPS-i : batch;
+        rt_tree_get_batch(t,kp+i,lens+i,j,out);
+        while(j-- > 0) if(out[j]) found--;
+    }
+    tbatch = now()-t0;
+
+    printf("%lu keys, %d lookups, batches of %lu\n",
+            (unsigned long)nkeys, NLOOKUPS, (unsigned long)batch);
+    printf("rt_tree_get:       %6.1f ns/lookup\n", tget*1e9/NLOOKUPS);
+    printf("rt_tree_get_batch: %6.1f ns/lookup (%.2fx)\n",
+            tbatch*1e9/NLOOKUPS, tget/tbatch);
+
+    rt_tree_free(t);
+    free(keys); free(kp); free(lens); free(out);
+    return found != 0;
+}
@@ -0,0 +1,146 @@
+
+/*
+ * Copyright 2012 William Heinbockel
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures insert throughput of an RT_FLAG_CONCURRENT tree and of a
+ * sharded tree against the number of writer threads. Each thread
+ * inserts its own share of the random keys into one shared tree, which
+ * is then checked for every key.
+ *
+ * usage: rt_bench_insert [nkeys] [max threads]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "radixtree.h"
+
+#define KEYLEN 16
+#define NSHARDS 64
+
+typedef struct {
+    rt_tree *t;
+    rt_sharded_tree *s;
+    unsigned char *keys;
+    size_t lo, hi;
+} writer;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void *
+insert(void *arg)
+{
+    writer *w = arg;
+    size_t i;
+    for(i=w->lo;i<w->hi;i++) {
+        if(w->s)
+            rt_sharded_set(w->s,w->keys+i*KEYLEN,KEYLEN,w->keys+i*KEYLEN);
+        else
+            rt_tree_set(w->t,w->keys+i*KEYLEN,KEYLEN,w->keys+i*KEYLEN);
+    }
+    return NULL;
+}
+
+/*
+ * Insert all keys with @a nthreads writers, into a sharded tree if
+ * @a sharded is set; returns the time taken
+ */
+static double
+run(unsigned int flags, int sharded, unsigned char *keys, size_t nkeys,
+        size_t nthreads, size_t *missing)
+{
+    pthread_t th[64];
+    writer w[64];
+    rt_tree *t = NULL;
+    rt_sharded_tree *s = NULL;
+    double t0, dt;
+    size_t i;
+    void *v;
+
+    if(sharded)
+        s = rt_sharded_new(64,NULL,NSHARDS,2,flags);
+    else
+        t = rt_tree_new_flags(64,NULL,flags);
+    if(!t && !s) return -1;
+    t0 = now();
+    for(i=0;i<nthreads;i++) {
+        w[i].t = t;
+        w[i].s = s;
+        w[i].keys = keys;
+        w[i].lo = nkeys*i/nthreads;
+        w[i].hi = nkeys*(i+1)/nthreads;
+        pthread_create(&th[i],NULL,insert,&w[i]);
+    }
+    for(i=0;i<nthreads;i++)
+        pthread_join(th[i],NULL);
+    dt = now()-t0;
+
+    for(i=0;i<nkeys;i++) {
+        v = s ? rt_sharded_get(s,keys+i*KEYLEN,KEYLEN)
+              : rt_tree_get(t,keys+i*KEYLEN,KEYLEN);
+        if(v != keys+i*KEYLEN) (*missing)++;
+    }
+    rt_tree_free(t);
+    rt_sharded_free(s);
+    return dt;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t nkeys = 1000000, maxthreads = 8, n, i, j, missing = 0;
+    unsigned char *keys;
+    double base, dt;
+
+    if(argc > 1) nkeys = strtoul(argv[1],NULL,10);
+    if(argc > 2) maxthreads = strtoul(argv[2],NULL,10);
+    if(nkeys < 1 || maxthreads < 1 || maxthreads > 64) return (-1);
+
+    keys = malloc(nkeys*KEYLEN);
+    if(!keys) {
+        printf("ERROR: Could not allocate benchmark data... Exiting\n");
+        return (-1);
+    }
+    srand(1);
+    for(i=0;i<nkeys;i++)
+        for(j=0;j<KEYLEN;j++) keys[i*KEYLEN+j] = '0'+rand()%64;
+
+    printf("%lu keys\n", (unsigned long)nkeys);
+    base = run(0,0,keys,nkeys,1,&missing);
+    printf("plain tree, 1 thread: %7.2f Mops/s\n", nkeys/base/1e6);
+    for(n=1;n<=maxthreads;n*=2) {
+        dt = run(RT_FLAG_CONCURRENT,0,keys,nkeys,n,&missing);
+        printf("concurrent, %2lu threads: %7.2f Mops/s (%.2fx)\n",
+                (unsigned long)n, nkeys/dt/1e6, base/dt);
+    }
+    for(n=1;n<=maxthreads;n*=2) {
+        dt = run(RT_FLAG_ARENA,1,keys,nkeys,n,&missing);
+        printf("%d shards,  %2lu threads: %7.2f Mops/s (%.2fx)\n",
+                NSHARDS, (unsigned long)n, nkeys/dt/1e6, base/dt);
+    }
+    if(missing) printf("ERROR: %lu keys missing\n", (unsigned long)missing);
+
+    free(keys);
+    return missing != 0;
+}
@@ -0,0 +1,142 @@
+
+/*
+ * Copyright 2012 William Heinbockel
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures regular expression queries over a tree of topic keys such
+ * as "prod.billing.eu-west.host0042.error": rt_tree_intersect with a
+ * compiled DFA against rt_tree_map with POSIX regexec in the callback.
+ * Both must find the same number of keys.
+ *
+ * usage: rt_bench_regex [nkeys]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <regex.h>
+#include "radixtree.h"
+
+static const char *envs[] = { "prod", "staging", "dev" };
+static const char *services[] = { "billing", "search", "auth", "ingest",
+    "mail", "cache", "web", "reports" };
+static const char *regions[] = { "eu-west", "eu-central", "us-east",
+    "us-west", "ap-south" };
+static const char *levels[] = { "debug", "info", "warn", "error" };
+
+static const char *patterns[] = {
+    "prod\\.billing\\..*\\.error",
+    "[a-z]+\\.(auth|mail)\\.us-[a-z]+\\.host00[0-9]+\\.(warn|error)",
+    ".*\\.host1234\\..*",
+    "(prod|dev)\\..*\\.eu-.*\\.host[0-9]*7\\.info",
+};
+
+#define N(a) (sizeof(a)/sizeof(*(a)))
+
+typedef struct {
+    regex_t re;
+    size_t count;
+} rb_ctxt;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void
+count(void *ctxt, unsigned char *key, size_t klen, void *value)
+{
+    (void)key; (void)klen; (void)value;
+    ((rb_ctxt *)ctxt)->count++;
+}
+
+static void
+match(void *ctxt, unsigned char *key, size_t klen, void *value)
+{
+    rb_ctxt *c = ctxt;
+    (void)klen; (void)value;
+    if(!regexec(&c->re,(char *)key,0,NULL,0)) c->count++;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t nkeys = 10000000, i, n, nhosts;
+    unsigned char key[64];
+    char anchored[256];
+    rt_tree *t;
+    rt_dfa *d;
+    rb_ctxt c;
+    double t0, dfa, posix;
+    int ret = 0;
+
+    if(argc > 1) nkeys = strtoul(argv[1],NULL,10);
+    if(nkeys < 1) return (-1);
+    t = rt_tree_new_flags(256,NULL,RT_FLAG_ARENA);
+    if(!t) return (-1);
+
+    /* distinct keys: the host numbers run past the other fields */
+    nhosts = nkeys/(N(envs)*N(services)*N(regions)*N(levels)) + 1;
+    srand(1);
+    for(i=0;i<nkeys;i++) {
+        n = sprintf((char *)key,"%s.%s.%s.host%04lu.%s",
+                envs[i%N(envs)], services[i/N(envs)%N(services)],
+                regions[rand()%N(regions)],
+                (unsigned long)(i/N(envs)/N(services)%nhosts),
+                levels[rand()%N(levels)]);
+        rt_tree_set(t,key,n,(void *)1);
+    }
+    printf("%lu keys\n", (unsigned long)nkeys);
+
+    for(i=0;i<N(patterns);i++) {
+        d = rt_dfa_new((const unsigned char *)patterns[i],
+                strlen(patterns[i]));
+        sprintf(anchored,"^(%s)$",patterns[i]);
+        if(!d || regcomp(&c.re,anchored,REG_EXTENDED|REG_NOSUB)) {
+            printf("ERROR: Could not compile %s\n", patterns[i]);
+            rt_dfa_free(d);
+            ret = -1;
+            continue;
+        }
+        c.count = 0;
+        t0 = now();
+        rt_tree_intersect(t,d,&c,count);
+        dfa = now()-t0;
+        n = c.count;
+
+        c.count = 0;
+        t0 = now();
+        rt_tree_map(t,&c,match);
+        posix = now()-t0;
+
+        printf("%s\n  intersect: %8lu keys %9.2f ms\n"
+               "  map+regexec: %6lu keys %9.2f ms (%.1fx)\n",
+                patterns[i], (unsigned long)n, dfa*1e3,
+                (unsigned long)c.count, posix*1e3, posix/dfa);
+        if(n != c.count) {
+            printf("ERROR: results differ\n");
+            ret = -1;
+        }
+        regfree(&c.re);
+        rt_dfa_free(d);
+    }
+    rt_tree_free(t);
+    return ret;
+}
@@ -33,7 +33,7 @@ main(int argc, char **argv)
 {
     rt_tree *t;
     char **arg;
-    int i, succ=0, def=0;
+    int i, succ=0, def=0, bulk=0;
 
     t = rt_tree_new(ALSIZE,NULL);
     if(!t) {
@@ -45,9 +45,23 @@ main(int argc, char **argv)
     if(argc>1 && *arg && !strcmp(*arg,"-d")) {
         def = 1;
         arg++; i++;
+    } else if(argc>1 && *arg && !strcmp(*arg,"-b")) {
+        def = bulk = 1;
+        arg++; i++;
     }
 
-    if(!def) {
+    if(bulk) {
+        size_t *lens = malloc((argc-i)*sizeof(size_t));
+        int j;
+        _DEBUG("Using rt_tree_build(%d)\n",bulk);
+        for(j=0;j<argc-i;j++) lens[j] = strlen(arg[j]);
+        if(rt_tree_build(t, (const unsigned char **)arg, lens,
+                    (void **)arg, argc-i))
+            succ = argc-i;
+        else{_DEBUG("!!! Bulk loading %d args... FAILED\n",argc-i);}
+        free(lens);
+        arg += argc-i;
+    } else if(!def) {
         _DEBUG("Using rt_tree_set(%d)\n",def);
         for(;i<argc;i++,arg++)
         {
@@ -16,6 +16,7 @@
  */
 
 #include <stdlib.h>
+#include <pthread.h>
 #include "radixtree.h"
 
 #ifdef NDEBUG
@@ -319,6 +320,1240 @@ static status test8()
     return ret;
 }
 
+static size_t vfree_count;
+
+static void count_vfree(void *value)
+{
+    if(value) vfree_count++;
+}
+
+/* test RT_FLAG_ARENA */
+static status test9()
+{
+    rt_tree *t;
+    char keys[200][4];
+    status ret = PASS;
+    int i;
+    t = rt_tree_new_flags(16,count_vfree,RT_FLAG_ARENA);
+    if(!t) return ERR;
+
+    for(i=0;i<200;i++) {
+        keys[i][0] = 'A'+i%16;
+        keys[i][1] = 'A'+(i/16)%16;
+        keys[i][2] = 'a'+i%3;
+        keys[i][3] = 0;
+        ASSERT(rt_tree_set(t,keys[i],3,keys[i]));
+    }
+    for(i=0;i<200;i++)
+        ASSERT(rt_tree_get(t,keys[i],3)==keys[i]);
+    for(i=0;i<200;i+=2)
+        ASSERT(rt_tree_remove(t,keys[i],3));
+    for(i=0;i<200;i++)
+        ASSERT((rt_tree_get(t,keys[i],3)!=NULL) == (i%2));
+    ASSERT(rt_tree_set(t,"ABCDEFGHIJKLMNOP",16,"ABCDEFGHIJKLMNOP"));
+
+    vfree_count = 0;
+    rt_tree_free(t);
+    ASSERT(vfree_count == 101);
+    return ret;
+}
+
+/* test node promotion and demotion across fanouts */
+static status test10()
+{
+    rt_tree *t;
+    unsigned char keys[128][3];
+    status ret = PASS;
+    int i, count = 0;
+    rt_iter *it;
+    t = rt_tree_new(128,NULL);
+    if(!t) return ERR;
+
+    for(i=0;i<128;i++) {
+        keys[i][0] = i+1;
+        keys[i][1] = 'x';
+        keys[i][2] = 0;
+        ASSERT(rt_tree_set(t,keys[i],2,keys[i]));
+    }
+    for(i=0;i<128;i++)
+        ASSERT(rt_tree_get(t,keys[i],2)==keys[i]);
+    it = rt_tree_prefix(t,NULL,0);
+    while(rt_iter_next(it)) {
+        ASSERT(rt_iter_value(it)==keys[count]);
+        count++;
+    }
+    rt_iter_free(it);
+    ASSERT(count==128);
+
+    /* shrink back down through every node kind */
+    for(i=0;i<126;i++) {
+        ASSERT(rt_tree_remove(t,keys[i],2));
+        ASSERT(rt_tree_get(t,keys[i+1],2)==keys[i+1]);
+    }
+    ASSERT(rt_tree_get(t,keys[127],2)==keys[127]);
+    rt_tree_free(t);
+
+    /* the alphabet size caps the node fanout */
+    t = rt_tree_new(5,NULL);
+    if(!t) return ERR;
+    for(i=0;i<5;i++)
+        ASSERT(rt_tree_set(t,keys[i],2,keys[i]));
+    ASSERT(!rt_tree_set(t,keys[5],2,keys[5]));
+    ASSERT(rt_tree_set(t,keys[4],1,keys[4]));
+    rt_tree_free(t);
+    return ret;
+}
+
+static long live_allocs;
+
+static void *count_malloc(size_t sz)
+{
+    live_allocs++;
+    return malloc(sz);
+}
+
+static void count_free(void *p)
+{
+    if(p) live_allocs--;
+    free(p);
+}
+
+/* test that rt_tree_remove prunes and re-merges nodes */
+static status test11()
+{
+    rt_tree *t;
+    char *keys[] = {"abc","abd","ab","a","abcdef","abcxyz","b","bcd",NULL};
+    status ret = PASS;
+    char **k;
+    live_allocs = 0;
+    t = rt_tree_malloc(16,NULL,count_malloc,realloc,count_free);
+    if(!t) return ERR;
+
+    /* tree + root */
+    ASSERT(live_allocs == 2);
+    for(k=keys;*k;k++)
+        ASSERT(rt_tree_set(t,*k,strlen(*k),*k));
+
+    /* "abc" and "abd" below a split "ab" node, which is merged back */
+    ASSERT(rt_tree_remove(t,"a",1));
+    ASSERT(rt_tree_remove(t,"ab",2));
+    ASSERT(rt_tree_remove(t,"abcdef",6));
+    ASSERT(rt_tree_remove(t,"abcxyz",6));
+    ASSERT(rt_tree_remove(t,"abd",3));
+    ASSERT(rt_tree_remove(t,"b",1));
+    /* root -> "abc", root -> "bcd" */
+    ASSERT(live_allocs == 4);
+    ASSERT(rt_tree_get(t,"abc",3) && rt_tree_get(t,"bcd",3));
+    ASSERT(!rt_tree_get(t,"ab",2) && !rt_tree_get(t,"b",1));
+
+    ASSERT(rt_tree_remove(t,"abc",3));
+    ASSERT(rt_tree_remove(t,"bcd",3));
+    ASSERT(live_allocs == 2);
+    for(k=keys;*k;k++)
+        ASSERT(!rt_tree_get(t,*k,strlen(*k)));
+
+    /* the tree is still usable */
+    for(k=keys;*k;k++)
+        ASSERT(rt_tree_set(t,*k,strlen(*k),*k));
+    for(k=keys;*k;k++)
+        ASSERT(rt_tree_get(t,*k,strlen(*k))==*k);
+
+    rt_tree_free(t);
+    ASSERT(live_allocs == 0);
+    return ret;
+}
+
+/* test rt_tree_build_sorted() and rt_tree_build() */
+static status test12()
+{
+    rt_tree *t;
+    const unsigned char *keys[] = {"a","ab","abc","abc","abd","b","bcd","bce"};
+    char *vals[] = {"a","ab","abc0","abc","abd","b","bcd","bce"};
+    const unsigned char *ukeys[] = {"bce","abc","a","b","abd","ab","bcd"};
+    size_t lens[8], ulens[7];
+    rt_iter *i;
+    int j, count = 0;
+    status ret = PASS;
+
+    for(j=0;j<8;j++) lens[j] = strlen(keys[j]);
+    for(j=0;j<7;j++) ulens[j] = strlen(ukeys[j]);
+
+    t = rt_tree_new(16,NULL);
+    if(!t) return ERR;
+    ASSERT(!rt_tree_build_sorted(NULL,keys,lens,(void **)vals,8));
+    /* unsorted input is rejected */
+    ASSERT(!rt_tree_build_sorted(t,ukeys,ulens,(void **)vals,7));
+    ASSERT(rt_tree_build_sorted(t,keys,lens,(void **)vals,8));
+    /* only empty trees can be loaded */
+    ASSERT(!rt_tree_build_sorted(t,keys,lens,(void **)vals,8));
+
+    for(j=0;j<8;j++)
+        ASSERT(!strcmp(rt_tree_get(t,keys[j],lens[j]),keys[j]));
+    ASSERT(!rt_tree_get(t,"bc",2));
+    i = rt_tree_prefix(t,NULL,0);
+    while(rt_iter_next(i)) count++;
+    rt_iter_free(i);
+    ASSERT(count == 7);
+
+    /* the loaded tree supports the usual updates */
+    ASSERT(rt_tree_set(t,"bc",2,"bc"));
+    ASSERT(rt_tree_remove(t,"abc",3));
+    ASSERT(rt_tree_get(t,"abd",3) && !rt_tree_get(t,"abc",3));
+    rt_tree_free(t);
+
+    t = rt_tree_new(16,NULL);
+    if(!t) return ERR;
+    ASSERT(rt_tree_build(t,ukeys,ulens,(void **)ukeys,7));
+    for(j=0;j<7;j++)
+        ASSERT(rt_tree_get(t,ukeys[j],ulens[j])==ukeys[j]);
+    rt_tree_free(t);
+
+    /* fanout beyond the alphabet size fails and leaves the tree empty */
+    t = rt_tree_new(1,NULL);
+    if(!t) return ERR;
+    ASSERT(!rt_tree_build(t,ukeys,ulens,(void **)ukeys,7));
+    ASSERT(!rt_tree_get(t,"a",1));
+    rt_tree_free(t);
+    return ret;
+}
+
+/* test rt_tree_get_batch() */
+static status test13()
+{
+    rt_tree *t;
+    unsigned char keys[100][4];
+    const unsigned char *kp[103];
+    size_t lens[103];
+    void *out[103];
+    status ret = PASS;
+    int i;
+    t = rt_tree_new(26,NULL);
+    if(!t) return ERR;
+
+    for(i=0;i<100;i++) {
+        keys[i][0] = 'a'+i%26;
+        keys[i][1] = 'a'+i/26;
+        keys[i][2] = 'a'+i%7;
+        keys[i][3] = 0;
+        kp[i] = keys[i];
+        lens[i] = 3;
+        /* only store every other key */
+        if(i%2) ASSERT(rt_tree_set(t,keys[i],3,keys[i]));
+    }
+    kp[100] = "ab"; lens[100] = 2;
+    kp[101] = NULL; lens[101] = 2;
+    kp[102] = "abzz"; lens[102] = 4;
+
+    rt_tree_get_batch(t,kp,lens,103,out);
+    for(i=0;i<103;i++)
+        ASSERT(out[i] == rt_tree_get(t,kp[i],lens[i]));
+    for(i=0;i<100;i++)
+        ASSERT(out[i] == (i%2 ? keys[i] : NULL));
+
+    out[0] = out[1] = kp[0];
+    rt_tree_get_batch(NULL,kp,lens,2,out);
+    ASSERT(!out[0] && !out[1]);
+    rt_tree_free(t);
+    return ret;
+}
+
+/* test rt_tree_freeze() */
+static status test14()
+{
+    rt_tree *t;
+    rt_frozen *f;
+    rt_frozen_iter *i;
+    char *keys[] = {"ABC","ACC","ACD","AZZ","AB","A","BAC","abc","zzz",NULL};
+    char **k;
+    int count = 0;
+    struct map_ctxt ctxt;
+    status ret = PASS;
+    t = rt_tree_new(16,NULL);
+    if(!t) return ERR;
+
+    ASSERT(rt_tree_freeze(NULL) == NULL);
+    for(k=keys;*k;k++)
+        ASSERT(rt_tree_set(t,*k,strlen(*k),*k));
+    f = rt_tree_freeze(t);
+    ASSERT(f != NULL);
+    if(!f) return FAIL;
+    /* the source tree is not modified */
+    rt_tree_free(t);
+
+    for(k=keys;*k;k++)
+        ASSERT(rt_frozen_get(f,*k,strlen(*k)) == *k);
+    ASSERT(!rt_frozen_get(f,"AC",2));
+    ASSERT(!rt_frozen_get(f,"ABCD",4));
+    ASSERT(!rt_frozen_get(NULL,"A",1));
+
+    i = rt_frozen_prefix(f,"A",1);
+    while(rt_frozen_iter_next(i)) {
+        count++;
+        ASSERT(rt_frozen_iter_key(i)[0] == 'A');
+        ASSERT(!strcmp(rt_frozen_iter_key(i),rt_frozen_iter_value(i)));
+    }
+    ASSERT(count == 6);
+    rt_frozen_iter_free(i);
+
+    i = rt_frozen_prefix(f,"Z",1);
+    ASSERT(i && !rt_frozen_iter_next(i));
+    rt_frozen_iter_free(i);
+
+    ctxt.fail = ctxt.pass = 0;
+    rt_frozen_map(f,&ctxt,map_cb);
+    ASSERT(ctxt.fail == 0);
+    ASSERT(ctxt.pass == 9);
+    ASSERT(rt_frozen_size(f) > 0);
+
+    rt_frozen_free(f);
+    return ret;
+}
+
+/* flip one byte of file @a path at @a off */
+static int corrupt(const char *path, long off)
+{
+    FILE *fp = fopen(path,"r+b");
+    int c;
+    if(!fp) return 0;
+    fseek(fp,off,SEEK_SET);
+    c = fgetc(fp);
+    fseek(fp,off,SEEK_SET);
+    fputc(c ^ 0xFF,fp);
+    return fclose(fp) == 0;
+}
+
+/* test rt_tree_save() and rt_tree_open_mmap() */
+static status test15()
+{
+    const char *path = "rt_test15.db";
+    rt_tree *t;
+    rt_frozen *f;
+    rt_frozen_iter *i;
+    char *keys[] = {"ABC","ACC","ACD","AZZ","AB","A","BAC","abc","zzz",NULL};
+    char **k;
+    const char *v;
+    int count = 0;
+    struct map_ctxt ctxt;
+    status ret = PASS;
+    t = rt_tree_new(16,NULL);
+    if(!t) return ERR;
+
+    for(k=keys;*k;k++)
+        ASSERT(rt_tree_set(t,*k,strlen(*k),*k));
+    ASSERT(!rt_tree_save(NULL,path,NULL));
+    ASSERT(rt_tree_save(t,path,NULL));
+    rt_tree_free(t);
+
+    ASSERT(rt_tree_open_mmap("rt_test15.missing") == NULL);
+    f = rt_tree_open_mmap(path);
+    ASSERT(f != NULL);
+    if(!f) return FAIL;
+    ASSERT(rt_frozen_verify(f));
+    for(k=keys;*k;k++) {
+        v = rt_frozen_get(f,*k,strlen(*k));
+        ASSERT(v && v != *k && !strcmp(v,*k));
+    }
+    ASSERT(!rt_frozen_get(f,"AC",2));
+
+    i = rt_frozen_prefix(f,"A",1);
+    while(rt_frozen_iter_next(i)) {
+        count++;
+        ASSERT(!strcmp(rt_frozen_iter_key(i),rt_frozen_iter_value(i)));
+    }
+    ASSERT(count == 6);
+    rt_frozen_iter_free(i);
+
+    ctxt.fail = ctxt.pass = 0;
+    rt_frozen_map(f,&ctxt,map_cb);
+    ASSERT(ctxt.fail == 0 && ctxt.pass == 9);
+    rt_frozen_free(f);
+
+    /* a damaged payload is caught by verify, a damaged header by open */
+    ASSERT(corrupt(path,100));
+    f = rt_tree_open_mmap(path);
+    ASSERT(f != NULL);
+    ASSERT(!rt_frozen_verify(f));
+    rt_frozen_free(f);
+    ASSERT(corrupt(path,12));
+    ASSERT(rt_tree_open_mmap(path) == NULL);
+
+    remove(path);
+    return ret;
+}
+
+/* readers for test16: the stable keys must stay visible throughout */
+struct conc_ctxt {
+    rt_tree *t;
+    char (*keys)[8];
+    int nkeys;
+    int stop;
+    int errors;
+};
+
+static void *conc_reader(void *arg)
+{
+    struct conc_ctxt *c = arg;
+    rt_iter *i;
+    int k, n, errors = 0;
+    while(!__atomic_load_n(&c->stop,__ATOMIC_ACQUIRE)) {
+        for(k=0;k<c->nkeys;k++)
+            if(rt_tree_get(c->t,c->keys[k],strlen(c->keys[k])) != c->keys[k])
+                errors++;
+        /* count the stable keys among the ones with prefix "s" */
+        n = 0;
+        i = rt_tree_prefix(c->t,"s",1);
+        while(rt_iter_next(i)) {
+            if(strcmp(rt_iter_key(i),rt_iter_value(i))) errors++;
+            if(rt_iter_value(i) >= (void *)c->keys
+                    && rt_iter_value(i) < (void *)(c->keys+c->nkeys))
+                n++;
+        }
+        rt_iter_free(i);
+        if(n != c->nkeys) errors++;
+    }
+    __atomic_add_fetch(&c->errors,errors,__ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* test RT_FLAG_CONCURRENT */
+static status test16()
+{
+    rt_tree *t;
+    pthread_t th[2];
+    char keys[64][8], churn[256][8];
+    int live[256] = {0};
+    struct conc_ctxt ctxt;
+    status ret = PASS;
+    size_t len;
+    int i, j;
+    t = rt_tree_new_flags(64,NULL,RT_FLAG_CONCURRENT);
+    if(!t) return ERR;
+
+    for(i=0;i<64;i++) {
+        sprintf(keys[i],"s%c%c",'a'+i%5,'a'+i/5);
+        ASSERT(rt_tree_set(t,keys[i],strlen(keys[i]),keys[i]));
+    }
+    /* churn keys split, grow, shrink and merge the nodes around them */
+    for(i=0;i<256;i++) {
+        if(i%3 == 0) sprintf(churn[i],"s%c%d",'a'+i%7,i);
+        else if(i%3 == 1) sprintf(churn[i],"%s%c",keys[i%64],'a'+i%26);
+        else sprintf(churn[i],"%c%d",'a'+i%26,i);
+    }
+    ctxt.t = t;
+    ctxt.keys = keys;
+    ctxt.nkeys = 64;
+    ctxt.stop = 0;
+    ctxt.errors = 0;
+    for(i=0;i<2;i++)
+        ASSERT(!pthread_create(&th[i],NULL,conc_reader,&ctxt));
+
+    for(j=0;j<20000;j++) {
+        i = (j*7919)%256;
+        len = strlen(churn[i]);
+        if(live[i]) {
+            ASSERT(rt_tree_remove(t,churn[i],len));
+        } else {
+            ASSERT(rt_tree_set(t,churn[i],len,churn[i]));
+        }
+        live[i] = !live[i];
+    }
+    __atomic_store_n(&ctxt.stop,1,__ATOMIC_RELEASE);
+    for(i=0;i<2;i++)
+        pthread_join(th[i],NULL);
+    ASSERT(ctxt.errors == 0);
+
+    rt_tree_synchronize(t);
+    rt_tree_synchronize(NULL);
+    for(i=0;i<64;i++)
+        ASSERT(rt_tree_get(t,keys[i],strlen(keys[i])) == keys[i]);
+    rt_tree_free(t);
+    return ret;
+}
+
+/* writers for test17: each one owns every fourth key */
+struct conc_writer {
+    rt_tree *t;
+    char (*keys)[8];
+    int id;
+    int errors;
+};
+
+static void *conc_writer(void *arg)
+{
+    struct conc_writer *w = arg;
+    size_t len;
+    int i, r;
+    for(r=0;r<20;r++) {
+        for(i=w->id;i<512;i+=4) {
+            len = strlen(w->keys[i]);
+            if(!rt_tree_set(w->t,w->keys[i],len,w->keys[i])) w->errors++;
+        }
+        /* the odd rounds remove every other key again */
+        for(i=w->id;i<512 && r%2;i+=8) {
+            len = strlen(w->keys[i]);
+            if(!rt_tree_remove(w->t,w->keys[i],len)) w->errors++;
+            if(rt_tree_get(w->t,w->keys[i],len)) w->errors++;
+        }
+    }
+    return NULL;
+}
+
+/* test concurrent writers */
+static status test17()
+{
+    rt_tree *t;
+    pthread_t th[4];
+    char keys[512][8];
+    struct conc_writer w[4];
+    status ret = PASS;
+    rt_iter *it;
+    int i, n;
+    t = rt_tree_new_flags(64,NULL,RT_FLAG_CONCURRENT);
+    if(!t) return ERR;
+
+    /* short keys from a small alphabet, so the writers share nodes */
+    for(i=0;i<512;i++)
+        sprintf(keys[i],"%c%c%d",'a'+i%3,'a'+i/3%5,i);
+    for(i=0;i<4;i++) {
+        w[i].t = t;
+        w[i].keys = keys;
+        w[i].id = i;
+        w[i].errors = 0;
+        ASSERT(!pthread_create(&th[i],NULL,conc_writer,&w[i]));
+    }
+    for(i=0;i<4;i++) {
+        pthread_join(th[i],NULL);
+        ASSERT(w[i].errors == 0);
+    }
+
+    for(i=0;i<512;i++) {
+        if(i%8 < 4) {
+            ASSERT(rt_tree_get(t,keys[i],strlen(keys[i])) == NULL);
+        } else {
+            ASSERT(rt_tree_get(t,keys[i],strlen(keys[i])) == keys[i]);
+        }
+    }
+    n = 0;
+    it = rt_tree_prefix(t,NULL,0);
+    while(rt_iter_next(it)) {
+        ASSERT(!strcmp(rt_iter_key(it),rt_iter_value(it)));
+        n++;
+    }
+    rt_iter_free(it);
+    ASSERT(n == 256);
+    rt_tree_free(t);
+    return ret;
+}
+
+/* writers for test18: each one inserts every fourth key */
+struct shard_writer {
+    rt_sharded_tree *s;
+    char (*keys)[8];
+    int id;
+    int errors;
+};
+
+static void *shard_writer(void *arg)
+{
+    struct shard_writer *w = arg;
+    int i;
+    for(i=w->id;i<512;i+=4)
+        if(!rt_sharded_set(w->s,w->keys[i],strlen(w->keys[i]),w->keys[i]))
+            w->errors++;
+    return NULL;
+}
+
+/* test rt_sharded_tree */
+static status test18()
+{
+    rt_sharded_tree *s;
+    rt_tree *t;
+    rt_iter *i;
+    rt_sharded_iter *si;
+    pthread_t th[4];
+    struct shard_writer w[4];
+    char keys[512][8];
+    status ret = PASS;
+    int j, n, nbytes;
+
+    for(j=0;j<512;j++)
+        sprintf(keys[j],"%c%c%d",'a'+j%7,'a'+j/7%3,j%37);
+    for(nbytes=1;nbytes<=2;nbytes++) {
+        s = rt_sharded_new(64,NULL,5,nbytes,RT_FLAG_ARENA);
+        t = rt_tree_new(64,NULL);
+        if(!s || !t) return ERR;
+        for(j=0;j<4;j++) {
+            w[j].s = s;
+            w[j].keys = keys;
+            w[j].id = j;
+            w[j].errors = 0;
+            ASSERT(!pthread_create(&th[j],NULL,shard_writer,&w[j]));
+        }
+        for(j=0;j<4;j++) {
+            pthread_join(th[j],NULL);
+            ASSERT(w[j].errors == 0);
+        }
+        for(j=0;j<512;j++) {
+            rt_tree_set(t,keys[j],strlen(keys[j]),keys[j]);
+            ASSERT(!strcmp(rt_sharded_get(s,keys[j],strlen(keys[j])),
+                        keys[j]));
+        }
+        ASSERT(rt_sharded_remove(s,"ab1",3));
+        ASSERT(!rt_sharded_remove(s,"ab1",3));
+        ASSERT(rt_sharded_get(s,"ab1",3) == NULL);
+        ASSERT(rt_sharded_setdefault(s,"ab1",3,"x") != NULL);
+        ASSERT(!strcmp(rt_sharded_setdefault(s,"ab1",3,"y"),"x"));
+        rt_tree_set(t,"ab1",3,"x");
+
+        /* merged and single shard iteration match the plain tree */
+        for(n=0;n<3;n++) {
+            si = rt_sharded_prefix(s,"ab",n);
+            i = rt_tree_prefix(t,"ab",n);
+            ASSERT(si && i);
+            while(rt_iter_next(i)) {
+                ASSERT(rt_sharded_iter_next(si));
+                ASSERT(!strcmp(rt_sharded_iter_key(si),rt_iter_key(i)));
+                ASSERT(!strcmp(rt_sharded_iter_value(si),rt_iter_value(i)));
+            }
+            ASSERT(!rt_sharded_iter_next(si));
+            rt_sharded_iter_free(si);
+            rt_iter_free(i);
+        }
+        rt_sharded_free(s);
+        rt_tree_free(t);
+    }
+    ASSERT(rt_sharded_new(64,NULL,4,3,0) == NULL);
+    ASSERT(rt_sharded_new(64,NULL,0,1,0) == NULL);
+    return ret;
+}
+
+/* mapfunc for test19: count the visits, and check the order per thread */
+static __thread char pmap_last[MAX_KEY_LENGTH+1];
+
+static void pmap_count(void *ctxt, unsigned char *key, size_t klen,
+        void *value)
+{
+    int *errors = ctxt;
+    __atomic_add_fetch((int *)value,1,__ATOMIC_RELAXED);
+    if(strlen(key) != klen) __atomic_add_fetch(errors,1,__ATOMIC_RELAXED);
+}
+
+static void pmap_ordered(void *ctxt, unsigned char *key, size_t klen,
+        void *value)
+{
+    int *errors = ctxt;
+    pmap_count(ctxt,key,klen,value);
+    if(strcmp(pmap_last,key) >= 0)
+        __atomic_add_fetch(errors,1,__ATOMIC_RELAXED);
+    strcpy(pmap_last,key);
+}
+
+/* test rt_tree_map_parallel */
+static status test19()
+{
+    rt_tree *t;
+    char (*keys)[12];
+    int *seen, errors = 0;
+    status ret = PASS;
+    int i, j, n = 20000, threads;
+    keys = malloc(n*sizeof(*keys));
+    seen = calloc(n,sizeof(*seen));
+    t = rt_tree_new(64,NULL);
+    if(!keys || !seen || !t) return ERR;
+
+    for(i=0;i<n;i++) {
+        sprintf(keys[i],"%c%c%d",'0'+i%64,'0'+i/64%64,i);
+        ASSERT(rt_tree_set(t,keys[i],strlen(keys[i]),&seen[i]));
+    }
+    ASSERT(rt_tree_set(t,"0",1,&seen[0]));
+    for(threads=1;threads<=8;threads*=2) {
+        rt_tree_map_parallel(t,threads,0,&errors,pmap_count);
+        pmap_last[0] = 0;
+        rt_tree_map_parallel(t,threads,RT_MAP_ORDERED,&errors,pmap_ordered);
+    }
+    ASSERT(errors == 0);
+    /* "0" shares its value with the first key */
+    ASSERT(seen[0] == 16);
+    for(j=1;j<n;j++)
+        ASSERT(seen[j] == 8);
+
+    rt_tree_free(t);
+    free(keys);
+    free(seen);
+    return ret;
+}
+
+/* test rt_iter_init */
+static status test20()
+{
+    rt_tree *t;
+    rt_iter_storage storage;
+    rt_iter *i, *j;
+    status ret = PASS;
+    int n;
+    t = rt_tree_new_flags(64,NULL,RT_FLAG_CONCURRENT);
+    if(!t) return ERR;
+    ASSERT(rt_iter_size() <= sizeof(storage));
+    ASSERT(rt_iter_init(&storage,NULL,NULL,0) == NULL);
+    ASSERT(rt_tree_set(t,"abc",3,"abc"));
+    ASSERT(rt_tree_set(t,"abd",3,"abd"));
+    ASSERT(rt_tree_set(t,"b",1,"b"));
+
+    /* the same storage serves one query after the other */
+    for(n=0;n<3;n++) {
+        i = rt_iter_init(&storage,t,"ab",2);
+        j = rt_tree_prefix(t,"ab",2);
+        ASSERT(i == (rt_iter *)&storage);
+        while(rt_iter_next(j)) {
+            ASSERT(rt_iter_next(i));
+            ASSERT(!strcmp(rt_iter_key(i),rt_iter_key(j)));
+            ASSERT(rt_iter_value(i) == rt_iter_value(j));
+        }
+        ASSERT(!rt_iter_next(i));
+        rt_iter_free(i);
+        rt_iter_free(j);
+    }
+    i = rt_iter_init(&storage,t,"x",1);
+    ASSERT(!rt_iter_next(i));
+    rt_iter_free(i);
+
+    /* freed iterators no longer hold back the writers */
+    ASSERT(rt_tree_remove(t,"b",1));
+    rt_tree_synchronize(t);
+    rt_tree_free(t);
+    return ret;
+}
+
+static void test21_map(void *ctxt, unsigned char *key, size_t klen,
+        void *value)
+{
+    size_t *total = ctxt;
+    if(klen == *(size_t *)value) *total += klen;
+}
+
+/* binary keys, with NUL bytes, far longer than MAX_KEY_LENGTH */
+static status test21()
+{
+    rt_tree *t;
+    rt_frozen *f;
+    rt_sharded_tree *s;
+    rt_iter *i;
+    rt_frozen_iter *fi;
+    rt_sharded_iter *si;
+    unsigned char *k[3];
+    size_t len[3] = { 4000, 5000, 5000 }, total;
+    status ret = PASS;
+    int n, m;
+    t = rt_tree_new_flags(64,NULL,RT_FLAG_CONCURRENT);
+    s = rt_sharded_new(64,NULL,4,2,0);
+    if(!t || !s) return ERR;
+    for(n=0;n<3;n++) {
+        k[n] = malloc(5000);
+        for(m=0;m<5000;m++) k[n][m] = m%7 ? (unsigned char)m : 0;
+    }
+    /* k[0] is a prefix of k[1], which sorts before k[2] */
+    k[2][4500] = 0xff;
+    for(n=0;n<3;n++) {
+        ASSERT(rt_tree_set(t,k[n],len[n],&len[n]));
+        ASSERT(rt_sharded_set(s,k[n],len[n],&len[n]));
+    }
+    for(n=0;n<3;n++)
+        ASSERT(rt_tree_get(t,k[n],len[n]) == &len[n]);
+    ASSERT(rt_tree_get(t,k[1],4999) == NULL);
+
+    i = rt_tree_prefix(t,k[1],4200);
+    ASSERT(rt_iter_next(i));
+    ASSERT(rt_iter_keylen(i) == 5000);
+    ASSERT(!memcmp(rt_iter_key(i),k[1],5000));
+    ASSERT(rt_iter_next(i));
+    ASSERT(!memcmp(rt_iter_key(i),k[2],5000));
+    ASSERT(!rt_iter_next(i));
+    rt_iter_free(i);
+
+    i = rt_tree_prefix(t,NULL,0);
+    fi = rt_frozen_prefix(f = rt_tree_freeze(t),NULL,0);
+    si = rt_sharded_prefix(s,NULL,0);
+    for(n=0;n<3;n++) {
+        ASSERT(rt_iter_next(i) && rt_frozen_iter_next(fi)
+                && rt_sharded_iter_next(si));
+        ASSERT(rt_iter_keylen(i) == len[n]);
+        ASSERT(rt_frozen_iter_keylen(fi) == len[n]);
+        ASSERT(rt_sharded_iter_keylen(si) == len[n]);
+        ASSERT(!memcmp(rt_iter_key(i),k[n],len[n]));
+        ASSERT(!memcmp(rt_frozen_iter_key(fi),k[n],len[n]));
+        ASSERT(!memcmp(rt_sharded_iter_key(si),k[n],len[n]));
+    }
+    ASSERT(!rt_iter_next(i));
+    ASSERT(!rt_frozen_iter_next(fi));
+    ASSERT(!rt_sharded_iter_next(si));
+    rt_iter_free(i);
+    rt_frozen_iter_free(fi);
+    rt_sharded_iter_free(si);
+    ASSERT(rt_frozen_get(f,k[2],5000) == &len[2]);
+
+    total = 0;
+    rt_tree_map(t,&total,test21_map);
+    ASSERT(total == 14000);
+    total = 0;
+    rt_tree_map_parallel(t,3,0,&total,test21_map);
+    ASSERT(total == 14000);
+    total = 0;
+    rt_frozen_map(f,&total,test21_map);
+    ASSERT(total == 14000);
+
+    ASSERT(rt_tree_remove(t,k[1],5000));
+    ASSERT(rt_tree_get(t,k[1],5000) == NULL);
+    ASSERT(rt_tree_get(t,k[2],5000) == &len[2]);
+    rt_frozen_free(f);
+
+    /* a path of 300 nodes, deeper than the inline iterator stack */
+    for(n=1;n<=300;n++)
+        ASSERT(rt_tree_set(t,k[0],n,k[0]));
+    i = rt_tree_prefix(t,k[0],1);
+    for(n=1;rt_iter_next(i);n++)
+        if(n <= 300) ASSERT(rt_iter_keylen(i) == n);
+    ASSERT(n == 303);
+    rt_iter_free(i);
+    rt_sharded_free(s);
+    rt_tree_free(t);
+    for(n=0;n<3;n++) free(k[n]);
+    return ret;
+}
+
+/* a 256 symbol alphabet: nodes with a child for every byte value */
+static status test22()
+{
+    rt_tree *t;
+    rt_frozen *f;
+    rt_iter *i;
+    unsigned char key[2];
+    int c, d, n;
+    status ret = PASS;
+    t = rt_tree_new(1000,NULL);
+    if(!t) return ERR;
+    for(c=0;c<256;c++) {
+        key[0] = c;
+        for(d=0;d<256;d++) {
+            key[1] = d;
+            ASSERT(rt_tree_set(t,key,2,(void *)(size_t)(c*256+d+1)));
+        }
+    }
+    key[0] = 0xab;
+    ASSERT(rt_tree_set(t,key,1,"ab"));
+    for(c=0;c<256;c++) {
+        key[0] = c;
+        key[1] = 255-c;
+        ASSERT(rt_tree_get(t,key,2) == (void *)(size_t)(c*256+255-c+1));
+    }
+    f = rt_tree_freeze(t);
+    ASSERT(f != NULL);
+    key[0] = 0;
+    key[1] = 0;
+    ASSERT(rt_frozen_get(f,key,2) == (void *)(size_t)1);
+    key[0] = 255;
+    key[1] = 255;
+    ASSERT(rt_frozen_get(f,key,2) == (void *)(size_t)65536);
+    ASSERT(rt_frozen_get(f,key,1) == NULL);
+    rt_frozen_free(f);
+
+    /* all 65537 keys in byte order */
+    i = rt_tree_prefix(t,NULL,0);
+    for(n=0;rt_iter_next(i);n++)
+        if(rt_iter_keylen(i) == 2 && (size_t)rt_iter_value(i) !=
+                (size_t)(rt_iter_key(i)[0]*256+rt_iter_key(i)[1]+1))
+            break;
+    ASSERT(n == 65537);
+    rt_iter_free(i);
+
+    /* full nodes shrink back as the children go */
+    for(d=0;d<256;d++) {
+        key[0] = 7;
+        key[1] = d;
+        ASSERT(rt_tree_remove(t,key,2));
+    }
+    key[1] = 0;
+    ASSERT(rt_tree_get(t,key,2) == NULL);
+    key[0] = 8;
+    ASSERT(rt_tree_get(t,key,2) == (void *)(size_t)(8*256+1));
+    rt_tree_free(t);
+    return ret;
+}
+
+static status test23()
+{
+    rt_tree *t;
+    rt_frozen *f;
+    const char *routes[] = { "/", "/api", "/api/v1", "/api/v1/users",
+        "/static" };
+    struct { const char *key; const char *want; } q[] = {
+        { "/api/v1/users/42", "/api/v1/users" },
+        { "/api/v1/user", "/api/v1" },
+        { "/api/v2", "/api" },
+        { "/ap", "/" },
+        { "/static", "/static" },
+        { "/statics", "/static" },
+        { "api", NULL },
+    };
+    size_t n, m, len;
+    status ret = PASS;
+    t = rt_tree_new(128,NULL);
+    if(!t) return ERR;
+    for(n=0;n<sizeof(routes)/sizeof(*routes);n++)
+        ASSERT(rt_tree_set(t,routes[n],strlen(routes[n]),(void *)routes[n]));
+    f = rt_tree_freeze(t);
+    for(m=0;m<2;m++) {
+        for(n=0;n<sizeof(q)/sizeof(*q);n++) {
+            len = 99;
+            ASSERT((m ? rt_frozen_longest_prefix(f,q[n].key,
+                            strlen(q[n].key),&len)
+                      : rt_tree_longest_prefix(t,q[n].key,
+                            strlen(q[n].key),&len)) == q[n].want);
+            ASSERT(len == (q[n].want ? strlen(q[n].want) : 0));
+        }
+    }
+    ASSERT(rt_tree_longest_prefix(t,"/api",0,&len) == NULL && len == 0);
+    ASSERT(rt_tree_longest_prefix(t,"/x",2,NULL) == routes[0]);
+
+    ASSERT(rt_tree_remove(t,"/api/v1",7));
+    ASSERT(rt_tree_longest_prefix(t,"/api/v1/user",12,&len) == routes[1]);
+    ASSERT(len == 4);
+    rt_frozen_free(f);
+    rt_tree_free(t);
+    return ret;
+}
+
+static status test24()
+{
+    rt_tree *t;
+    rt_iter *i;
+    const char *keys[] = { "b", "ba", "bab", "bb", "d", "da" };
+    struct { const char *key; int mode; const char *first; } q[] = {
+        { "ba", RT_SEEK_GE, "ba" },  { "ba", RT_SEEK_GT, "bab" },
+        { "ba", RT_SEEK_LE, "ba" },  { "ba", RT_SEEK_LT, "b" },
+        { "bac", RT_SEEK_GE, "bb" }, { "bac", RT_SEEK_LE, "bab" },
+        { "c", RT_SEEK_GE, "d" },    { "c", RT_SEEK_LT, "bb" },
+        { "a", RT_SEEK_GE, "b" },    { "a", RT_SEEK_LE, NULL },
+        { "e", RT_SEEK_GT, NULL },   { "e", RT_SEEK_LT, "da" },
+        { "", RT_SEEK_GE, "b" },     { "", RT_SEEK_LT, NULL },
+    };
+    size_t n, m;
+    status ret = PASS;
+    t = rt_tree_new(128,NULL);
+    if(!t) return ERR;
+    for(n=0;n<sizeof(keys)/sizeof(*keys);n++)
+        ASSERT(rt_tree_set(t,keys[n],strlen(keys[n]),(void *)keys[n]));
+    ASSERT(rt_tree_seek(t,"b",1,7) == NULL);
+
+    for(n=0;n<sizeof(q)/sizeof(*q);n++) {
+        i = rt_tree_seek(t,q[n].key,strlen(q[n].key),q[n].mode);
+        if(!q[n].first) {
+            ASSERT(!rt_iter_next(i));
+        } else {
+            /* the rest of the tree follows in order */
+            for(m=0;strcmp(keys[m],q[n].first);m++);
+            for(;rt_iter_next(i);m++)
+                ASSERT(m < 6 && !strcmp(rt_iter_key(i),keys[m]));
+            ASSERT(m == 6);
+        }
+        rt_iter_free(i);
+    }
+
+    i = rt_tree_range(t,"ba",2,"d",1);
+    for(m=1;rt_iter_next(i);m++)
+        ASSERT(rt_iter_value(i) == keys[m]);
+    ASSERT(m == 4);
+    rt_iter_free(i);
+    i = rt_tree_range(t,NULL,0,"bab",3);
+    for(m=0;rt_iter_next(i);m++);
+    ASSERT(m == 2);
+    rt_iter_free(i);
+    rt_tree_free(t);
+    return ret;
+}
+
+static status test25()
+{
+    rt_tree *t;
+    rt_iter *i;
+    const char *keys[] = { "a", "v1", "v10", "v2", "v20", "v3", "w" };
+    size_t n;
+    status ret = PASS;
+    t = rt_tree_new(128,NULL);
+    if(!t) return ERR;
+    for(n=0;n<7;n++)
+        ASSERT(rt_tree_set(t,keys[n],strlen(keys[n]),(void *)keys[n]));
+
+    /* the last two keys under "v" */
+    i = rt_tree_prefix_flags(t,"v",1,RT_ITER_DESC);
+    ASSERT(rt_iter_next(i) && !strcmp(rt_iter_key(i),"v3"));
+    ASSERT(rt_iter_next(i) && !strcmp(rt_iter_key(i),"v20"));
+    ASSERT(rt_iter_prev(i) && !strcmp(rt_iter_key(i),"v3"));
+    ASSERT(!rt_iter_prev(i));
+    ASSERT(rt_iter_next(i) && !strcmp(rt_iter_key(i),"v3"));
+    rt_iter_free(i);
+
+    /* walk off both ends and turn around */
+    i = rt_tree_prefix(t,NULL,0);
+    ASSERT(!rt_iter_prev(i));
+    for(n=0;rt_iter_next(i);n++)
+        ASSERT(rt_iter_value(i) == keys[n]);
+    ASSERT(n == 7);
+    ASSERT(!rt_iter_next(i));
+    for(;rt_iter_prev(i);n--)
+        ASSERT(rt_iter_value(i) == keys[n-1]);
+    ASSERT(n == 0);
+    ASSERT(rt_iter_next(i) && rt_iter_value(i) == keys[0]);
+    rt_iter_free(i);
+
+    i = rt_tree_seek(t,"v2",2,RT_SEEK_LT|RT_ITER_DESC);
+    ASSERT(rt_iter_next(i) && !strcmp(rt_iter_key(i),"v10"));
+    ASSERT(rt_iter_next(i) && !strcmp(rt_iter_key(i),"v1"));
+    rt_iter_free(i);
+    i = rt_tree_seek(t,"v2",2,RT_SEEK_GT|RT_ITER_DESC);
+    ASSERT(rt_iter_next(i) && !strcmp(rt_iter_key(i),"v20"));
+    ASSERT(rt_iter_next(i) && !strcmp(rt_iter_key(i),"v2"));
+    rt_iter_free(i);
+
+    /* ranges hold in both directions */
+    i = rt_tree_range(t,"v10",3,"v3",2);
+    ASSERT(!rt_iter_prev(i));
+    ASSERT(rt_iter_next(i) && !strcmp(rt_iter_key(i),"v10"));
+    ASSERT(rt_iter_next(i) && rt_iter_next(i) && !rt_iter_next(i));
+    ASSERT(rt_iter_prev(i) && !strcmp(rt_iter_key(i),"v20"));
+    rt_iter_free(i);
+    rt_tree_free(t);
+    return ret;
+}
+
+/* test rt_tree_match() */
+static status test26()
+{
+    rt_tree *t;
+    const char *keys[] = { "user.1.session.a", "user.1.session.ab",
+        "user.22.session.b", "user.22.profile.b", "users.3.session.c",
+        "group.1.session.d", "u", "a*b", "a]b" };
+    struct { const char *pattern; size_t count; const char *last; } q[] = {
+        { "user.*.session.?", 2, "user.22.session.b" },
+        { "user.*", 4, "user.22.session.b" },
+        { "*.session.*", 5, "users.3.session.c" },
+        { "user[.s]*.[!s.]*.?", 2, "users.3.session.c" },
+        { "*", 9, "users.3.session.c" },
+        { "?", 1, "u" },
+        { "a\\*b", 1, "a*b" },
+        { "a[]*]b", 2, "a]b" },
+        { "user.1", 0, NULL },
+        { "", 0, NULL },
+    };
+    struct map_ctxt ctxt;
+    size_t n;
+    status ret = PASS;
+    t = rt_tree_new(256,NULL);
+    if(!t) return ERR;
+    for(n=0;n<sizeof(keys)/sizeof(*keys);n++)
+        ASSERT(rt_tree_set(t,keys[n],strlen(keys[n]),(void *)keys[n]));
+    for(n=0;n<sizeof(q)/sizeof(*q);n++) {
+        memset(&ctxt,0,sizeof(ctxt));
+        ASSERT(rt_tree_match(t,q[n].pattern,strlen(q[n].pattern),
+                    &ctxt,map_cb));
+        ASSERT(ctxt.fail == 0 && ctxt.pass == q[n].count);
+        /* keys come in order, the last one is the largest */
+        ASSERT(q[n].last ? ctxt.lval == q[n].last : !ctxt.lval);
+    }
+    ASSERT(!rt_tree_match(t,"user[.",6,&ctxt,map_cb));
+    ASSERT(!rt_tree_match(t,"*",1,&ctxt,NULL));
+    ASSERT(!rt_tree_match(NULL,"*",1,&ctxt,map_cb));
+    rt_tree_free(t);
+    return ret;
+}
+
+/* test rt_tree_fuzzy() */
+static status test27()
+{
+    rt_tree *t;
+    const char *keys[] = { "cat", "cart", "cast", "act", "at", "coat",
+        "dog", "scatter" };
+    struct {
+        const char *key;
+        unsigned int dist, flags;
+        size_t count;
+        const char *last;
+    } q[] = {
+        { "cat", 0, 0, 1, "cat" },
+        { "cat", 1, 0, 5, "coat" },
+        { "cta", 1, 0, 0, NULL },
+        { "cta", 1, RT_FUZZY_DAMERAU, 1, "cat" },
+        { "cta", 2, 0, 4, "coat" },
+        { "act", 1, RT_FUZZY_DAMERAU, 3, "cat" },
+        { "", 2, 0, 1, "at" },
+        { "scat", 3, 0, 7, "scatter" },
+        { "xyz", 2, 0, 0, NULL },
+    };
+    struct map_ctxt ctxt;
+    size_t n;
+    status ret = PASS;
+    t = rt_tree_new(256,NULL);
+    if(!t) return ERR;
+    for(n=0;n<sizeof(keys)/sizeof(*keys);n++)
+        ASSERT(rt_tree_set(t,keys[n],strlen(keys[n]),(void *)keys[n]));
+    for(n=0;n<sizeof(q)/sizeof(*q);n++) {
+        memset(&ctxt,0,sizeof(ctxt));
+        ASSERT(rt_tree_fuzzy(t,q[n].key,strlen(q[n].key),q[n].dist,
+                    q[n].flags,&ctxt,map_cb));
+        ASSERT(ctxt.fail == 0 && ctxt.pass == q[n].count);
+        ASSERT(q[n].last ? ctxt.lval == q[n].last : !ctxt.lval);
+    }
+    ASSERT(!rt_tree_fuzzy(t,NULL,3,1,0,&ctxt,map_cb));
+    ASSERT(!rt_tree_fuzzy(t,"cat",3,1,0,&ctxt,NULL));
+    rt_tree_free(t);
+    return ret;
+}
+
+/* test rt_dfa_new() and rt_tree_intersect() */
+static status test28()
+{
+    rt_tree *t;
+    rt_dfa *d;
+    const char *keys[] = { "log.auth.error", "log.auth.info",
+        "log.mail.error", "log.web", "logs", "metric.cpu.0",
+        "metric.cpu.12", "metric.mem" };
+    struct { const char *regex; size_t count; const char *last; } q[] = {
+        { "log\\.(auth|mail)\\.error", 2, "log.mail.error" },
+        { "log\\..*", 4, "log.web" },
+        { "log(\\.[a-z]+)+", 4, "log.web" },
+        { "metric\\.cpu\\.[0-9]+", 2, "metric.cpu.12" },
+        { "metric\\.cpu\\.[^0]", 0, NULL },
+        { "logs?", 1, "logs" },
+        { ".*", 8, "metric.mem" },
+        { "", 0, NULL },
+    };
+    const char *bad[] = { "(log", "log)", "*log", "log|+", "[log" };
+    struct map_ctxt ctxt;
+    size_t n;
+    status ret = PASS;
+    t = rt_tree_new(256,NULL);
+    if(!t) return ERR;
+    for(n=0;n<sizeof(keys)/sizeof(*keys);n++)
+        ASSERT(rt_tree_set(t,keys[n],strlen(keys[n]),(void *)keys[n]));
+    for(n=0;n<sizeof(q)/sizeof(*q);n++) {
+        d = rt_dfa_new(q[n].regex,strlen(q[n].regex));
+        ASSERT(d);
+        memset(&ctxt,0,sizeof(ctxt));
+        ASSERT(rt_tree_intersect(t,d,&ctxt,map_cb));
+        ASSERT(ctxt.fail == 0 && ctxt.pass == q[n].count);
+        ASSERT(q[n].last ? ctxt.lval == q[n].last : !ctxt.lval);
+        rt_dfa_free(d);
+    }
+    for(n=0;n<sizeof(bad)/sizeof(*bad);n++)
+        ASSERT(!rt_dfa_new(bad[n],strlen(bad[n])));
+    ASSERT(!rt_tree_intersect(t,NULL,&ctxt,map_cb));
+    rt_tree_free(t);
+    return ret;
+}
+
+/* test RT_FLAG_COUNT, rt_tree_count_prefix(), rank and select */
+static status test29()
+{
+    rt_tree *t;
+    rt_iter *i;
+    const char *keys[] = { "page.1", "page.10", "page.2", "post", "post.1",
+        "user" };
+    unsigned int flags[] = { 0, RT_FLAG_COUNT, RT_FLAG_COUNT|RT_FLAG_ARENA };
+    size_t n, m;
+    status ret = PASS;
+    ASSERT(!rt_tree_new_flags(256,NULL,RT_FLAG_COUNT|RT_FLAG_CONCURRENT));
+    for(m=0;m<sizeof(flags)/sizeof(*flags);m++) {
+        t = rt_tree_new_flags(256,NULL,flags[m]);
+        if(!t) return ERR;
+        ASSERT(rt_tree_count_prefix(t,NULL,0) == 0);
+        for(n=0;n<sizeof(keys)/sizeof(*keys);n++)
+            ASSERT(rt_tree_set(t,keys[n],strlen(keys[n]),(void *)keys[n]));
+        /* replacing a value does not count twice */
+        ASSERT(rt_tree_set(t,"post",4,(void *)keys[3]));
+        ASSERT(rt_tree_setdefault(t,"user",4,(void *)keys[0]) == keys[5]);
+
+        ASSERT(rt_tree_count_prefix(t,NULL,0) == 6);
+        ASSERT(rt_tree_count_prefix(t,"p",1) == 5);
+        ASSERT(rt_tree_count_prefix(t,"page.1",6) == 2);
+        ASSERT(rt_tree_count_prefix(t,"pa",2) == 3);
+        ASSERT(rt_tree_count_prefix(t,"pages",5) == 0);
+
+        ASSERT(rt_tree_rank(t,"page.1",6) == 0);
+        ASSERT(rt_tree_rank(t,"page.2",6) == 2);
+        ASSERT(rt_tree_rank(t,"page.3",6) == 3);
+        ASSERT(rt_tree_rank(t,"post.0",6) == 4);
+        ASSERT(rt_tree_rank(t,"q",1) == 5);
+        ASSERT(rt_tree_rank(t,"z",1) == 6);
+        ASSERT(rt_tree_rank(t,NULL,0) == 0);
+
+        for(n=0;n<=sizeof(keys)/sizeof(*keys);n++) {
+            i = rt_tree_select(t,n);
+            ASSERT(i);
+            if(n < sizeof(keys)/sizeof(*keys)) {
+                ASSERT(rt_iter_next(i) && rt_iter_value(i) == keys[n]);
+                if(n > 0) ASSERT(rt_iter_prev(i)
+                        && rt_iter_value(i) == keys[n-1]);
+            } else {
+                ASSERT(!rt_iter_next(i));
+            }
+            rt_iter_free(i);
+        }
+
+        /* the counts follow removals, merges and splits */
+        ASSERT(rt_tree_remove(t,"page.10",7));
+        ASSERT(!rt_tree_remove(t,"page.10",7));
+        ASSERT(rt_tree_remove(t,"post",4));
+        ASSERT(rt_tree_set(t,"pa",2,(void *)keys[0]));
+        ASSERT(rt_tree_count_prefix(t,"p",1) == 4);
+        ASSERT(rt_tree_count_prefix(t,"pa",2) == 3);
+        ASSERT(rt_tree_count_prefix(t,"po",2) == 1);
+        ASSERT(rt_tree_rank(t,"post.1",6) == 3);
+        i = rt_tree_select(t,3);
+        ASSERT(rt_iter_next(i) && !strcmp(rt_iter_key(i),"post.1"));
+        rt_iter_free(i);
+        rt_tree_free(t);
+    }
+    return ret;
+}
+
+static void *
+iter_free_all(void *arg)
+{
+    rt_iter **i = arg;
+    size_t n;
+    for(n=0;n<100;n++)
+        rt_iter_free(i[n]);
+    return NULL;
+}
+
+/* test more open iterators on a concurrent tree than it has reader slots */
+static status test30()
+{
+    rt_tree *t;
+    rt_iter *i[300];
+    pthread_t th;
+    size_t n;
+    status ret = PASS;
+    t = rt_tree_new_flags(256,NULL,RT_FLAG_CONCURRENT);
+    if(!t) return ERR;
+    ASSERT(rt_tree_set(t,"a",1,(void *)t));
+    for(n=0;n<300;n++) {
+        i[n] = rt_tree_prefix(t,NULL,0);
+        ASSERT(i[n]);
+    }
+    ASSERT(rt_tree_set(t,"b",1,(void *)i));
+    ASSERT(rt_tree_get(t,"b",1) == i);
+    for(n=0;n<300;n++)
+        ASSERT(rt_iter_next(i[n]) && rt_iter_value(i[n]) == t);
+    /* iterators may be freed by another thread */
+    ASSERT(!pthread_create(&th,NULL,iter_free_all,i));
+    pthread_join(th,NULL);
+    for(n=100;n<300;n++)
+        rt_iter_free(i[n]);
+    rt_tree_synchronize(t);
+    rt_tree_free(t);
+    return ret;
+}
+
 int
 main()
 {
@@ -332,6 +1567,28 @@ main()
     TEST(test6());
     TEST(test7());
     TEST(test8());
+    TEST(test9());
+    TEST(test10());
+    TEST(test11());
+    TEST(test12());
+    TEST(test13());
+    TEST(test14());
+    TEST(test15());
+    TEST(test16());
+    TEST(test17());
+    TEST(test18());
+    TEST(test19());
+    TEST(test20());
+    TEST(test21());
+    TEST(test22());
+    TEST(test23());
+    TEST(test24());
+    TEST(test25());
+    TEST(test26());
+    TEST(test27());
+    TEST(test28());
+    TEST(test29());
+    TEST(test30());
 
 #ifndef NDEBUG
     printf("%s: Passed %u of %u tests\n",